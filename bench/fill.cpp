@@ -0,0 +1,62 @@
+// Times rectangle fills on an 801x801 canvas, the size main.cpp uses: the
+// old path, one vertical line() per column, against filled_rectangle(),
+// which fills one row span and copies it down.
+//
+//     g++ bench/fill.cpp -o bench_fill -std=c++2a -O2 -pthread && ./bench_fill
+#include <chrono>
+#include <cstdio>
+
+#include "../lib/grid.hpp"
+
+// The per-column fill filled_rectangle() used before it worked by spans.
+void column_rectangle(Canvas *canvas, int x1, int y1, int x2, int y2) {
+  for (int x = x1; x <= x2; x++) {
+    canvas -> line(x, y1, x, y2);
+  }
+}
+
+// Milliseconds per call of f, after a warm-up call.
+template<class F>
+double time_ms(int runs, F f) {
+  f();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++) {
+    f();
+  }
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / runs;
+}
+
+int main() {
+  const int RUNS = 200;
+  Canvas canvas(801, 801, Color::white);
+  Grid grid(100, 100, 800, 800);
+  Color palette[8] = {Color::black, Color::red, Color::blue, Color::green, Color::yellow};
+  for (int k = 0; k < 100 * 100; k++) {
+    grid.board[k] = k % 5;
+  }
+
+  double grid_old = time_ms(RUNS, [&]() {
+    for (int i = 0; i < grid.grid_x; i++) {
+      for (int j = 0; j < grid.grid_y; j++) {
+        canvas.selected = palette[grid.board[j + i * grid.grid_x]];
+        column_rectangle(&canvas, grid.starting_x(i), grid.starting_y(j), grid.ending_x(i), grid.ending_y(j));
+      }
+    }
+  });
+  double grid_new = time_ms(RUNS, [&]() {
+    grid.draw_grid(palette, &canvas);
+  });
+  canvas.selected = Color::red;
+  double full_old = time_ms(RUNS, [&]() {
+    column_rectangle(&canvas, 0, 0, 800, 800);
+  });
+  double full_new = time_ms(RUNS, [&]() {
+    canvas.filled_rectangle(0, 0, 800, 800);
+  });
+
+  printf("%-32s %8s %8s\n", "", "columns", "spans");
+  printf("%-32s %8.3f %8.3f ms\n", "Grid::draw_grid (10k cells)", grid_old, grid_new);
+  printf("%-32s %8.3f %8.3f ms\n", "full-frame filled_rectangle", full_old, full_new);
+  return 0;
+}
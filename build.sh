@@ -1,3 +1,9 @@
 # sudo apt install freeglut3-dev libfmt-dev binutils-dev
 
-g++ main.cpp -lGL -lGLU -lglut -o paint -std=c++2a -lfmt -lbfd -g
+g++ main.cpp -lGL -lGLU -lglut -o paint -std=c++2a -O2 -lfmt -lbfd -pthread -g
+
+# Checks the scenario generators' random streams; exits with 1 on overlap.
+g++ check/streams.cpp -o check_streams -std=c++2a -O2 -pthread && ./check_streams
+
+# Rectangle fill benchmark: per-column lines against row spans.
+g++ bench/fill.cpp -o bench_fill -std=c++2a -O2 -pthread
@@ -0,0 +1,28 @@
+// Checks that the random streams of the scenario generators do not
+// overlap: the first draws of each chunk must not show up in any other
+// chunk's. Exits with 1 and names the chunks if they do.
+#include <cstdio>
+#include <unordered_map>
+
+#include "../lib/scenario.hpp"
+
+int main() {
+  const int CHUNKS = 64;
+  const int DRAWS = 4096;
+  int failures = 0;
+  for (uint64_t seed : {0ull, 1ull, 2ull, 42ull, 12345ull}) {
+    std::unordered_map<uint64_t, int> owner;
+    for (int c = 0; c < CHUNKS; c++) {
+      scenario::Random random(seed, c);
+      for (int i = 0; i < DRAWS; i++) {
+        auto seen = owner.emplace(random.next(), c);
+        if (!seen.second && seen.first -> second != c) {
+          printf("seed %llu: chunks %d and %d share draws\n", (unsigned long long)seed, seen.first -> second, c);
+          failures++;
+          break;
+        }
+      }
+    }
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -6,7 +6,11 @@
 #include <GL/gl.h>
 
 #include "lib/stacktrace.hpp"
+#include "lib/profiler.hpp"
+#include "lib/logger.hpp"
 #include "lib/board.hpp"
+#include "lib/scenario.hpp"
+#include "lib/emitter.hpp"
 
 using namespace std;
 
@@ -14,58 +18,109 @@ class Galaxy
 {
 public:
   Particle sun;
-  vector<Particle *> asteroids;
+  ParticlePool asteroids;
   Canvas *img;
+  Splat *splat = NULL;  // density view instead of drawing each asteroid
+  // Asteroids farther than this from the sun are lost.
+  static constexpr double RADIUS = 300;
+  Population *population;  // replaces or removes the lost ones
 
   Galaxy() : sun(0, Vector(400, 400), Color::yellow)
   {
+    population = new Population(Region{sun.position, RADIUS}, NULL, 0, 0, rand());
     img = new Canvas(800 + 1, 800 + 1, Color::black);
+    img->set_deferred(worker_count() > 1);
     for (int i = 0; i < 100; i++)
     {
-      asteroids.push_back(new Particle(Vector::random_unit() * DEFAULT_SPEED * RAND_DOUBLE, Vector(800 * RAND_DOUBLE, 800 * RAND_DOUBLE), hsl(RAND_DOUBLE * 360)));
-      cout << "Generated new particle" << asteroids.back()->to_string() << endl;
+      asteroids.push_back(Particle(Vector::random_unit() * DEFAULT_SPEED * RAND_DOUBLE, Vector(800 * RAND_DOUBLE, 800 * RAND_DOUBLE), hsl(RAND_DOUBLE * 360)));
+      const Particle &p = asteroids[asteroids.size() - 1];
+      LOG_DEBUG("Generated new particle speed=({:.3f}, {:.3f}) position=({:.3f}, {:.3f}) color=({},{},{})",
+                p.speed.x, p.speed.y, p.position.x, p.position.y, int(p.color.r), int(p.color.g), int(p.color.b));
     }
   }
 
-  void draw()
+  // Replaces the asteroids from a PARTICLES_SCENARIO value: disc:N,
+  // plummer:N or kepler:N, each with an optional :seed, or a scenario file.
+  bool load_scenario(const string &spec)
   {
-    img->fade(0.99);
-    for (auto p : asteroids)
+    size_t colon = spec.find(':');
+    string kind = spec.substr(0, colon);
+    if (colon == string::npos || (kind != "disc" && kind != "plummer" && kind != "kepler"))
     {
-      p->draw(img);
+      return scenario::load(spec, asteroids);
     }
-    sun.draw(img);
-    img->render(0, 0);
+    char *end;
+    size_t n = strtoull(spec.c_str() + colon + 1, &end, 10);
+    uint64_t seed = *end == ':' ? strtoull(end + 1, NULL, 10) : rand();
+    if (kind == "disc")
+    {
+      scenario::uniform_disc(asteroids, n, sun.position, RADIUS, DEFAULT_SPEED, seed);
+    }
+    else if (kind == "plummer")
+    {
+      scenario::plummer(asteroids, n, sun.position, RADIUS / 5, RADIUS, DEFAULT_SPEED, seed);
+    }
+    else
+    {
+      // heartbeat() pulls every asteroid toward the sun with a constant 1.
+      scenario::keplerian(asteroids, n, sun.position, RADIUS * 0.1, RADIUS * 0.9, [](double) { return 1.0; }, seed);
+    }
+    LOG_INFO("Generated {} asteroids for {}", n, kind);
+    return true;
   }
 
-  void delete_far_asteroids()
+  void draw()
   {
-    vector<Particle *> close;
-    for (auto p : asteroids)
+    if (splat != NULL)
     {
-      double distance = (p->position - sun.position).magnitude();
-      cout << "Particle at distance " << distance << endl;
-      if (distance > 300)
-      {
-        delete p;
-      }
-      else
+      splat->add(asteroids.size(), [&](int i) {
+        const Particle &p = asteroids[i];
+        return Splat::Point{p.position.x, p.position.y, p.color};
+      });
+      img->draw_splat(*splat);
+    }
+    else
+    {
+      img->fade(0.99);
+      for (auto &p : asteroids)
       {
-        close.push_back(p);
+        p.draw(img);
       }
     }
-    asteroids = close;
+    sun.draw(img);
+    img->render(0, 0);
   }
 
-  void heartbeat()
+  // From now on, asteroids that are lost are replaced from e, up to rate
+  // a frame (0 for all), keeping the current number.
+  void keep_population(Emitter *e, size_t rate)
   {
-    delete_far_asteroids();
-    for (auto p : asteroids)
+    population->emitter = e;
+    population->target = asteroids.size();
+    population->rate = rate;
+  }
+
+  void recycle_far_asteroids()
+  {
+    population->step(asteroids);
+    if (population->removed > 0)
+    {
+      LOG_INFO("Removed {} far asteroids, {} left", population->removed, asteroids.size());
+    }
+    if (population->respawned + population->added > 0)
     {
-      p->heartbeat();
-      double angle = (p->position - sun.position).angle() + M_PI;
-      p->speed += Vector::polar(angle, 1);
+      LOG_DEBUG("Respawned {} far asteroids, added {}", population->respawned, population->added);
     }
+  }
+
+  void heartbeat()
+  {
+    recycle_far_asteroids();
+    // Each asteroid moves, then falls toward the sun with a pull of 1.
+    parallel_for(asteroids.size(), 1 << 15, [&](int begin, int end) {
+      kernels::orbit(&asteroids[begin].speed.x, end - begin, sizeof(Particle) / sizeof(double),
+                     sun.position.x, sun.position.y);
+    });
     draw();
   }
 };
@@ -87,20 +142,16 @@ void eventoTeclado(unsigned char k, int x, int y)
 void renderFunction()
 {
   g->draw();
-  glFlush();
-  glutSwapBuffers();
 }
 
 void heartbeat(int)
 {
   g->heartbeat();
-  renderFunction();
   glutTimerFunc(20, heartbeat, 0);
 }
 
 void opengl_init(int argc, char **argv, int width, int height)
 {
-  g = new Galaxy();
   glutInit(&argc, argv);
   glutInitDisplayMode(GLUT_DOUBLE);
   glutInitWindowSize(width, height);
@@ -121,9 +172,88 @@ int main(int argc, char **argv)
   srand((unsigned)time(NULL));
   std::cin.tie(0);
   std::cin.sync_with_stdio(0);
+  if (argc == 3 && string(argv[1]) == "--symbolize")
+  {
+    // Turns a saved crash report back into file names and lines.
+    ifstream report(argv[2]);
+    stringstream text;
+    text << report.rdbuf();
+    cout << Teuchos::symbolize_crash_report(text.str());
+    return 0;
+  }
+  if (argc == 4 && string(argv[1]) == "--write-scenario")
+  {
+    // Generates or converts a scenario once, for PARTICLES_SCENARIO.
+    Galaxy galaxy;
+    return galaxy.load_scenario(argv[2]) && scenario::save(argv[3], galaxy.asteroids) ? 0 : 1;
+  }
   Teuchos::print_stack_on_segfault();
+  const char *profile = getenv("PARTICLES_PROFILE");
+  if (profile != NULL && !profiler::start_from_spec(profile))
+  {
+    cerr << "bad PARTICLES_PROFILE: " << profile << endl;
+  }
+  const char *log = getenv("PARTICLES_LOG");
+  if (log != NULL && !logger::set_output(log))
+  {
+    cerr << "cannot open PARTICLES_LOG: " << log << endl;
+  }
+  const char *display = getenv("PARTICLES_DISPLAY");
+  string backend = display ? display : "glut";
+  Presenter *presenter = make_presenter(backend);
+  if (presenter == NULL)
+  {
+    return 1;
+  }
+  g = new Galaxy();
+  LOG_INFO("Using {} kernels", kernels::name());
+  g->img->presenter = presenter;
+  const char *scene = getenv("PARTICLES_SCENARIO");
+  if (scene != NULL && !g->load_scenario(scene))
+  {
+    return 1;
+  }
+  const char *emitter = getenv("PARTICLES_EMITTER");
+  if (emitter != NULL)
+  {
+    // disc, orbit or jet, with an optional :rate per frame.
+    string spec = emitter;
+    Emitter *e = make_emitter(spec, g->sun.position, Galaxy::RADIUS, DEFAULT_SPEED);
+    if (e == NULL)
+    {
+      return 1;
+    }
+    size_t colon = spec.find(':');
+    g->keep_population(e, colon == string::npos ? 0 : strtoull(spec.c_str() + colon + 1, NULL, 10));
+  }
+  const char *trail = getenv("PARTICLES_TRAIL");
+  if (trail != NULL && string(trail) == "lazy")
+  {
+    g->img->set_trail(0.99);
+  }
+  const char *splat = getenv("PARTICLES_SPLAT");
+  if (splat != NULL && string(splat) == "1")
+  {
+    g->splat = new Splat(g->img->width(), g->img->height());
+  }
+
+  if (backend != "glut")
+  {
+    // Headless run: no window, frames go straight to the presenter.
+    const char *frames = getenv("PARTICLES_FRAMES");
+    int limit = frames ? atoi(frames) : 0;
+    for (int frame = 0; limit == 0 || frame < limit; frame++)
+    {
+      g->heartbeat();
+    }
+    delete presenter;
+    return 0;
+  }
+
   int width = 800, height = 800;
   opengl_init(argc, argv, width, height);
+  // The window brought in the GL driver libraries.
+  Teuchos::refresh_module_map();
   glutMouseFunc(eventoClick);
   glutMotionFunc(eventoArrastre);
   glutDisplayFunc(renderFunction);
@@ -14,6 +14,15 @@ class Board {
   int width;
   int heigth;
   Color *palette = new Color[8];
+  // One byte per pixel while enabled, see set_indexed(). Its palette is
+  // palette[0..7], then the same colors at half brightness for the
+  // particles, then the white background.
+  IndexedImage *frame = NULL;
+  static const int HALF = 8;
+  static const int BACKGROUND = 15;
+  // Per particle, during heartbeat(): its cell and palette index.
+  std::vector<int> cells;
+  std::vector<int> teams;
 
   Board() {
     palette[0] = Color::black;
@@ -32,6 +41,38 @@ class Board {
     particles -> create_random_particle_at(800 * RAND_DOUBLE, 800 * RAND_DOUBLE, palette[1]);
     grid = new Grid(100, 100, width, heigth);
     img = new Canvas(width+1, heigth+1, Color::white);
+    set_indexed(true);
+  }
+
+  void set_indexed(bool on) {
+    delete frame;
+    frame = NULL;
+    if (on) {
+      frame = new IndexedImage(img -> width(), img -> height(), BACKGROUND);
+      for (int i = 0; i < HALF; i++) {
+        frame -> set_palette(i, palette[i]);
+        frame -> set_palette(HALF + i, palette[i] * 0.5);
+      }
+      frame -> set_palette(BACKGROUND, Color::white);
+    }
+    // Without it, the grid is 10k rectangles a frame; rasterize them
+    // tile-parallel. With a single core, binning would only add work.
+    img -> set_deferred(!on && worker_count() > 1);
+  }
+
+  // Gives team i a new color. With the indexed frame that is a palette
+  // change; the pixels are left alone.
+  void recolor(int i, const Color& c) {
+    for (auto& particle : particles -> particles) {
+      if (particle -> color == palette[i]) {
+        particle -> color = c;
+      }
+    }
+    palette[i] = c;
+    if (frame != NULL) {
+      frame -> set_palette(i, c);
+      frame -> set_palette(HALF + i, c * 0.5);
+    }
   }
 
   int color_index(const Color& c){
@@ -44,29 +85,74 @@ class Board {
   }
 
   void render() {
-    img -> reset(Color::white);
-    grid -> draw_grid(palette, img);
-    particles -> draw(img);
+    if (frame != NULL) {
+      frame -> fill(BACKGROUND);
+      grid -> draw_grid(frame);
+      for (auto& particle : particles -> particles) {
+        particle -> draw(frame, HALF + color_index(particle -> color));
+      }
+      img -> draw_indexed(*frame);
+    } else {
+      img -> reset(Color::white);
+      grid -> draw_grid(palette, img);
+      particles -> draw(img);
+    }
     img -> render(0, 0);
   }
 
+  // Grid capture runs in parallel. Every particle first claims its cell;
+  // the lowest index among those in a cell owns it and paints it. The
+  // owner changed the cell if the cell had another color, any other
+  // particle there if the owner's color is not its own, and a particle
+  // that changed its cell bounces off the border it crossed. Nothing
+  // depends on thread count or order, so any machine gives the same frames.
   void heartbeat() {
     particles -> heartbeat();
-    for (auto& particle : particles -> particles) {
-      if (grid -> set_color(particle -> position.x, particle -> position.y, color_index(particle -> color))) {
-        auto prev = particle -> position - particle -> speed;
-        if (grid -> grid_x_of(prev.x) != grid -> grid_x_of(particle -> position.x)) {
-          particle -> speed.x *= -1;
+    int n = particles -> particles.size();
+    cells.resize(n);
+    teams.resize(n);
+    const int GRAIN = 1 << 14;
+    parallel_for(n, GRAIN, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        auto particle = particles -> particles[i];
+        cells[i] = grid -> cell_of(particle -> position.x, particle -> position.y);
+        teams[i] = color_index(particle -> color);
+        grid -> claim(cells[i], i);
+      }
+    });
+    parallel_for(n, GRAIN, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        int cell = cells[i];
+        int owner = grid -> owner[cell].load(std::memory_order_relaxed);
+        bool changed;
+        if (owner == i) {
+          // Only the owner touches the cell.
+          changed = grid -> board[cell] != teams[i];
+          grid -> board[cell] = teams[i];
+        } else {
+          changed = teams[owner] != teams[i];
         }
-        if (grid -> grid_y_of(prev.y) != grid -> grid_y_of(particle -> position.y)) {
-          particle -> speed.y *= -1;
+        if (changed) {
+          auto particle = particles -> particles[i];
+          auto prev = particle -> position - particle -> speed;
+          if (grid -> grid_x_of(prev.x) != grid -> grid_x_of(particle -> position.x)) {
+            particle -> speed.x *= -1;
+          }
+          if (grid -> grid_y_of(prev.y) != grid -> grid_y_of(particle -> position.y)) {
+            particle -> speed.y *= -1;
+          }
         }
       }
-    }
+    });
+    parallel_for(n, GRAIN, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        if (grid -> owner[cells[i]].load(std::memory_order_relaxed) == i) {
+          grid -> release(cells[i]);
+        }
+      }
+    });
 
     render();
-    glFlush();
-    glutSwapBuffers();
   }
 
   void split() {
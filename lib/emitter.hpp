@@ -0,0 +1,147 @@
+#ifndef EMITTER_HPP
+#define EMITTER_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "particle.hpp"
+#include "scenario.hpp"
+
+// Sources of new particles, for keeping a population steady while
+// particles escape.
+class Emitter {
+public:
+virtual ~Emitter() {}
+
+virtual Particle emit(scenario::Random& random) const = 0;
+};
+
+// Anywhere in a disc, moving in any direction.
+class DiscEmitter : public Emitter {
+public:
+Vector center;
+double radius, max_speed;
+
+DiscEmitter(const Vector& c, double r, double v) : center(c), radius(r), max_speed(v) {
+}
+
+Particle emit(scenario::Random& random) const override {
+        return scenario::disc_particle(random, center, radius, max_speed);
+}
+};
+
+// Circular orbits around the center under a constant pull, like the
+// galaxy's.
+class OrbitEmitter : public Emitter {
+public:
+Vector center;
+double r0, r1, pull;
+
+OrbitEmitter(const Vector& c, double inner, double outer, double g) : center(c), r0(inner), r1(outer), pull(g) {
+}
+
+Particle emit(scenario::Random& random) const override {
+        return scenario::orbit_particle(random, center, r0, r1, [&](double) { return pull; });
+}
+};
+
+// A stream from one point, heading within `spread` radians of a direction,
+// with speeds between half and all of `speed`.
+class JetEmitter : public Emitter {
+public:
+Vector origin;
+double heading, spread, speed;
+
+JetEmitter(const Vector& o, double h, double s, double v) : origin(o), heading(h), spread(s), speed(v) {
+}
+
+Particle emit(scenario::Random& random) const override {
+        double angle = heading + spread * (2 * random.uniform() - 1);
+        double v = speed * (0.5 + 0.5 * random.uniform());
+        return Particle(Vector(v * std::cos(angle), v * std::sin(angle)), origin,
+                        hsl(int(360 * random.uniform())));
+}
+};
+
+// A circle particles are meant to stay in.
+struct Region {
+        Vector center;
+        double radius;
+
+        bool contains(const Vector& p) const {
+                double dx = p.x - center.x, dy = p.y - center.y;
+                return dx * dx + dy * dy <= radius * radius;
+        }
+};
+
+// Keeps a pool at `target` particles inside a region. Each step, particles
+// that left are respawned in their slot by the emitter, at most `rate` a
+// step (0 for no limit); the rest are compacted out, keeping the order of
+// the live ones, and later steps emit into the slots they freed until the
+// pool is back to target. The pool reserves target once and never grows
+// past it, so a long run allocates nothing. Without an emitter particles
+// are only removed.
+class Population {
+public:
+Region region;
+Emitter *emitter;
+size_t target, rate;
+
+// What the last step did.
+size_t respawned = 0, removed = 0, added = 0;
+
+private:
+scenario::Random random_;
+
+public:
+Population(const Region& r, Emitter *e, size_t t, size_t per_step, uint64_t seed)
+        : region(r), emitter(e), target(t), rate(per_step), random_(seed, 0) {
+}
+
+void step(ParticlePool& pool) {
+        size_t budget = emitter == NULL ? 0 : (rate == 0 ? SIZE_MAX : rate);
+        size_t size = pool.size();
+        respawned = removed = added = 0;
+        for (Particle& p : pool) {
+                if (budget == respawned)
+                        break;
+                if (!region.contains(p.position)) {
+                        p = emitter->emit(random_);
+                        respawned++;
+                }
+        }
+        budget -= respawned;
+        // Escapees left over once the budget ran out. remove_if is a stable
+        // partition for the side that is kept and, unlike
+        // std::stable_partition, needs no scratch buffer.
+        pool.retain([&](const Particle& p) { return region.contains(p.position); });
+        removed = size - pool.size();
+        if (emitter != NULL) {
+                pool.reserve(target);
+                while (pool.size() < target && added < budget) {
+                        pool.push_back(emitter->emit(random_));
+                        added++;
+                }
+        }
+}
+};
+
+// PARTICLES_EMITTER values for a galaxy around center: disc, orbit or
+// jet, optionally followed by :rate. NULL, with a message, for anything
+// else.
+inline Emitter* make_emitter(const std::string& spec, const Vector& center, double radius, double speed) {
+        std::string kind = spec.substr(0, spec.find(':'));
+        if (kind == "disc")
+                return new DiscEmitter(center, radius, speed);
+        if (kind == "orbit")
+                return new OrbitEmitter(center, radius * 0.1, radius * 0.9, 1);
+        if (kind == "jet")
+                return new JetEmitter(center + Vector(-radius * 0.8, 0), M_PI / 2, 0.3, 2 * speed);
+        std::cerr << "Unknown emitter '" << spec << "'" << std::endl;
+        return NULL;
+}
+
+#endif
@@ -1,11 +1,18 @@
 #ifndef GRID_HPP
 #define GRID_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+
 #include "paint/canvas.h"
 
 class Grid {
  public:
   int *board;
+  // Per cell, the lowest index of a particle that entered it this frame,
+  // INT_MAX when none has. See claim().
+  std::atomic<int> *owner;
   int grid_x;
   int grid_y;
 
@@ -17,8 +24,11 @@ class Grid {
     grid_y = y;
     width = w;
     heigth = h;
-    board = new int[x * y];
-    memset(board, 0, sizeof(board));
+    board = new int[x * y]();
+    owner = new std::atomic<int>[x * y];
+    for (int k = 0; k < x * y; k++) {
+      owner[k].store(INT_MAX, std::memory_order_relaxed);
+    }
   }
 
   int starting_x(int x) const {
@@ -56,6 +66,29 @@ class Grid {
     return false;
   }
 
+  // Particle::bound() lets a particle sit exactly on the far edges; those
+  // belong to the last row and column.
+  int cell_of(double x, double y) {
+    int i = std::clamp(grid_x_of(x), 0, grid_x - 1);
+    int j = std::clamp(grid_y_of(y), 0, grid_y - 1);
+    return j + i * grid_x;
+  }
+
+  // Marks cell as entered by particle, which owns it if no particle with
+  // a lower index claims it too. Any thread, any order: the owner only
+  // depends on who claimed, so it is the same for any number of threads.
+  void claim(int cell, int particle) {
+    int current = owner[cell].load(std::memory_order_relaxed);
+    while (particle < current &&
+           !owner[cell].compare_exchange_weak(current, particle, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Called by the owner once every claim of the frame is in and read.
+  void release(int cell) {
+    owner[cell].store(INT_MAX, std::memory_order_relaxed);
+  }
+
   void draw_particle(int i, int j, const Color * const palette, Canvas * canvas) const {
     // std::cout << "Drawing (" << i << ", " <<  j << ") at "
     //           << "(" << starting_x(i) << "," << starting_y(j) << ") >> "
@@ -73,6 +106,15 @@ class Grid {
       }
     }
   }
+
+  // Same cells, written as palette indices.
+  void draw_grid(IndexedImage* frame) const {
+    for(int i = 0; i < grid_x; i++) {
+      for (int j = 0; j < grid_y; j++) {
+        frame->rect(starting_x(i), starting_y(j), ending_x(i), ending_y(j), board[j + i * grid_x]);
+      }
+    }
+  }
 };
 
 #endif
@@ -0,0 +1,300 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <fmt/format.h>
+
+// Asynchronous logger. LOG_INFO("{} asteroids left", n) copies the format
+// string pointer and the raw bytes of its arguments into a ring owned by
+// the calling thread and returns; a background thread formats the entries
+// with fmt, in time order across threads, and writes them out in batches.
+// The calling thread never formats or blocks: if its ring is full the
+// entry is dropped and counted. Only a thread's first entry locks, to
+// register the thread, and allocates its 64 KiB ring unless one left
+// by an exited thread can be reused.
+//
+// Levels below LOG_LEVEL are removed at compile time, arguments included:
+//
+//     g++ -DLOG_LEVEL=0 ...   // everything, down to LOG_TRACE
+//
+// Arguments must be trivially copyable or strings. Strings are copied and
+// share what is left of the entry after the other arguments, so very long
+// ones are cut short.
+namespace logger {
+
+enum Level { TRACE, DEBUG, INFO, WARN, ERROR, OFF };
+
+const int SLOTS = 512;  // entries per thread, a power of two
+const int ENTRY_SIZE = 128;
+
+typedef void (*Decoder)(fmt::memory_buffer& out, const char *format, const uint8_t *args);
+
+struct Entry {
+        Decoder decode;
+        const char *format;
+        const char *file;
+        int64_t time;
+        uint32_t line;
+        uint8_t level;
+        uint8_t args[ENTRY_SIZE - 37];
+};
+
+static_assert(sizeof(Entry) == ENTRY_SIZE, "Entry must fill its slot");
+
+// Single producer, single consumer: the owning thread moves head, the
+// logging thread moves tail.
+struct Ring {
+        alignas(64) std::atomic<uint32_t> head{0};
+        alignas(64) std::atomic<uint32_t> tail{0};
+        std::atomic<bool> retired{false};  // the owner has exited
+        Entry entries[SLOTS];
+};
+
+struct Backend {
+        std::mutex mutex;  // guards rings, taken once per thread and by the drain
+        std::vector<Ring*> rings;
+        std::vector<Ring*> spare;  // drained rings of exited threads
+        std::thread thread;
+        std::atomic<bool> running{false};
+        std::atomic<uint64_t> dropped{0};
+        std::once_flag started;
+        std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+        int fd = STDERR_FILENO;
+};
+
+inline Backend backend;
+
+// How each argument type is stored in an entry.
+template <typename T> struct stored { typedef T type; };
+template <> struct stored<const char*> { typedef std::string_view type; };
+template <> struct stored<char*> { typedef std::string_view type; };
+template <> struct stored<std::string> { typedef std::string_view type; };
+template <typename T> using stored_t = typename stored<std::decay_t<T>>::type;
+
+template <typename T>
+constexpr size_t fixed_size() {
+        if constexpr (std::is_same_v<T, std::string_view>)
+                return sizeof(uint16_t);
+        else
+                return sizeof(T);
+}
+
+template <typename T>
+void encode(uint8_t *&p, uint8_t *end, const T& value) {
+        if constexpr (std::is_same_v<stored_t<T>, std::string_view>) {
+                std::string_view text(value);
+                uint16_t n = std::min<size_t>(text.size(), end - p - sizeof(uint16_t));
+                memcpy(p, &n, sizeof(n));
+                memcpy(p + sizeof(n), text.data(), n);
+                p += sizeof(n) + n;
+        } else {
+                static_assert(std::is_trivially_copyable_v<T>, "log arguments must be trivially copyable or strings");
+                memcpy(p, &value, sizeof(T));
+                p += sizeof(T);
+        }
+}
+
+template <typename T>
+T decode_arg(const uint8_t *&p) {
+        if constexpr (std::is_same_v<T, std::string_view>) {
+                uint16_t n;
+                memcpy(&n, p, sizeof(n));
+                std::string_view text(reinterpret_cast<const char*>(p + sizeof(n)), n);
+                p += sizeof(n) + n;
+                return text;
+        } else {
+                T value;
+                memcpy(&value, p, sizeof(T));
+                p += sizeof(T);
+                return value;
+        }
+}
+
+template <typename... Args>
+void decode(fmt::memory_buffer& out, const char *format, const uint8_t *p) {
+        // Braced initialization reads the arguments left to right.
+        std::tuple<Args...> args{decode_arg<Args>(p)...};
+        std::apply([&](const Args&... a) {
+                fmt::format_to(std::back_inserter(out), fmt::runtime(format), a...);
+        }, args);
+}
+
+inline void start();
+
+// The calling thread's ring, registered on first use and handed back to
+// the logging thread when the thread exits.
+inline Ring *thread_ring() {
+        struct Owner {
+                Ring *ring = NULL;
+                ~Owner() {
+                        if (ring != NULL)
+                                ring->retired = true;
+                }
+        };
+        thread_local Owner owner;
+        if (owner.ring == NULL) {
+                std::call_once(backend.started, start);
+                std::lock_guard<std::mutex> lock(backend.mutex);
+                if (backend.spare.empty()) {
+                        owner.ring = new Ring();
+                } else {
+                        owner.ring = backend.spare.back();
+                        backend.spare.pop_back();
+                        owner.ring->retired = false;
+                }
+                backend.rings.push_back(owner.ring);
+        }
+        return owner.ring;
+}
+
+template <typename... Args>
+void write(Level level, const char *file, int line, fmt::format_string<const Args&...> format, const Args&... args) {
+        static_assert((fixed_size<stored_t<Args>>() + ... + 0) <= sizeof(Entry::args), "too many log arguments");
+        Ring *ring = thread_ring();
+        uint32_t head = ring->head.load(std::memory_order_relaxed);
+        if (head - ring->tail.load(std::memory_order_acquire) == SLOTS) {
+                backend.dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+        }
+        Entry& e = ring->entries[head & (SLOTS - 1)];
+        e.decode = decode<stored_t<Args>...>;
+        e.format = fmt::string_view(format).data();
+        e.file = file;
+        e.line = line;
+        e.level = level;
+        e.time = (std::chrono::steady_clock::now() - backend.epoch).count();
+        uint8_t *p = e.args;
+        uint8_t *end = e.args + sizeof(e.args) - (fixed_size<stored_t<Args>>() + ... + 0);
+        // Each string may use what the arguments after it do not need.
+        ((end += fixed_size<stored_t<Args>>(), encode(p, end, args)), ...);
+        ring->head.store(head + 1, std::memory_order_release);
+}
+
+inline void write_all(const char *data, size_t size) {
+        while (size > 0) {
+                ssize_t n = ::write(backend.fd, data, size);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return;
+                data += n;
+                size -= n;
+        }
+}
+
+// Formats and writes everything logged so far.
+inline void drain() {
+        static const char *const NAMES[] = {"TRACE", "DEBUG", "INFO ", "WARN ", "ERROR"};
+        struct Pending {
+                Ring *ring;
+                uint32_t head;
+                bool retired;
+        };
+        std::vector<Pending> pending;
+        {
+                std::lock_guard<std::mutex> lock(backend.mutex);
+                for (Ring *ring : backend.rings) {
+                        // A retired ring gets no more entries once the flag is seen.
+                        bool retired = ring->retired.load(std::memory_order_acquire);
+                        pending.push_back(Pending{ring, ring->head.load(std::memory_order_acquire), retired});
+                }
+        }
+        std::vector<const Entry*> batch;
+        for (const Pending& p : pending)
+                for (uint32_t i = p.ring->tail.load(std::memory_order_relaxed); i != p.head; i++)
+                        batch.push_back(&p.ring->entries[i & (SLOTS - 1)]);
+        std::stable_sort(batch.begin(), batch.end(), [](const Entry *a, const Entry *b) {
+                return a->time < b->time;
+        });
+
+        fmt::memory_buffer out;
+        for (const Entry *e : batch) {
+                const char *slash = strrchr(e->file, '/');
+                fmt::format_to(std::back_inserter(out), "{:12.6f} {} {}:{} ",
+                               e->time * 1e-9, NAMES[e->level], slash ? slash + 1 : e->file, e->line);
+                e->decode(out, e->format, e->args);
+                out.push_back('\n');
+        }
+        for (const Pending& p : pending)
+                p.ring->tail.store(p.head, std::memory_order_release);
+        write_all(out.data(), out.size());
+
+        std::lock_guard<std::mutex> lock(backend.mutex);
+        for (const Pending& p : pending) {
+                if (p.retired) {
+                        // Drained up to its last entry, ready for another thread.
+                        backend.rings.erase(std::find(backend.rings.begin(), backend.rings.end(), p.ring));
+                        backend.spare.push_back(p.ring);
+                }
+        }
+}
+
+// Stops the logging thread after writing what is left. Runs at exit.
+inline void stop() {
+        if (!backend.running.exchange(false))
+                return;
+        backend.thread.join();
+        drain();
+        uint64_t dropped = backend.dropped.load();
+        if (dropped > 0) {
+                std::string note = fmt::format("logger: {} messages dropped\n", dropped);
+                write_all(note.data(), note.size());
+        }
+}
+
+inline void start() {
+        backend.running = true;
+        backend.thread = std::thread([]() {
+                while (backend.running) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                        drain();
+                }
+        });
+        atexit(stop);
+}
+
+// Sends the log to a file instead of stderr. Call before logging.
+inline bool set_output(const std::string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+                return false;
+        backend.fd = fd;
+        return true;
+}
+
+}  // namespace logger
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL logger::INFO
+#endif
+
+#define LOG_AT(level, ...)                                                              \
+        do {                                                                            \
+                if constexpr ((level) >= (LOG_LEVEL))                                   \
+                        logger::write((level), __FILE__, __LINE__, __VA_ARGS__);        \
+        } while (0)
+
+#define LOG_TRACE(...) LOG_AT(logger::TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(logger::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(logger::INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(logger::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(logger::ERROR, __VA_ARGS__)
+
+#endif
@@ -7,9 +7,16 @@
 #include <algorithm>
 #include <cmath>
 #include <utility>
-#include <stack>
+#include <vector>
 
+#include "commands.h"
 #include "image.h"
+#include "indexed.h"
+#include "pipeline.h"
+#include "presenter.h"
+#include "raster.h"
+#include "splat.h"
+#include "trail.h"
 #include "utils.h"
 
 using std::swap;
@@ -20,6 +27,9 @@ Image canvas;
 Color selected;
 Color background;
 int eraser_size = 10;
+Presenter *presenter = NULL;
+Trail *trail = NULL;
+CommandList *commands = NULL;
 
 public:
 Canvas(int w, int h, const Color& c = Color::white) : canvas(w, h, c) {
@@ -34,109 +44,147 @@ int height() {
         return canvas.height();
 }
 
-  #ifdef GL_POINTS
 void render(int x, int y) {
+        flush();
+        if (trail != NULL)
+                trail->resolve(canvas);
+        if (presenter != NULL) {
+                presenter->present(canvas);
+                return;
+        }
+  #ifdef GL_POINTS
         canvas.draw_at(0, 0);
-}
   #endif
+}
+
+Rect bounds() const {
+        return canvas.bounds();
+}
 
 void draw(int y, int x) {
-        try {
-                canvas.at(x, y) = selected;
-        } catch(int e) {}
+        if (deferred()) {
+                commands->point(y, x, selected);
+                return;
+        }
+        if (!canvas.inside(x, y))
+                return;
+        if (trail != NULL)
+                trail->plot(x, y, selected);
+        else
+                canvas.pixel(x, y) = selected;
 }
 
 void reset(const Color& c) {
-        for (auto& p : canvas) {
-                p = c;
+        if (deferred()) {
+                commands->rect(0, 0, width() - 1, height() - 1, c);
+                return;
         }
+        canvas.fill(c);
+}
+
+// In deferred mode draw(), line(), span(), filled_rectangle(), reset() and
+// the erasers are recorded and rasterized tile by tile on worker threads at
+// the next flush(), and everything built on them (circles, polygons, ...)
+// follows. Anything that reads the canvas flushes first. Trail mode keeps
+// drawing immediately.
+void set_deferred(bool on) {
+        flush();
+        delete commands;
+        commands = on ? new CommandList() : NULL;
+}
+
+bool deferred() const {
+        return commands != NULL && trail == NULL;
+}
+
+void flush() {
+        if (commands != NULL && !commands->empty())
+                commands->execute(canvas.view());
 }
 
 void erase(int y, int x) {
-        for (int i = -eraser_size; i <= eraser_size; i++)
-                for (int j = -eraser_size; j <= eraser_size; j++)
-                        single_erase(y, x);
+        if (deferred()) {
+                commands->rect(y - eraser_size, x - eraser_size, y + eraser_size, x + eraser_size, background);
+                return;
+        }
+        Rect r = Rect{y - eraser_size, x - eraser_size,
+                      y + eraser_size, x + eraser_size}.intersect(bounds());
+        for (int i = r.y0; i <= r.y1; i++)
+                for (int j = r.x0; j <= r.x1; j++)
+                        canvas.pixel(i, j) = background;
 }
 
+// In trail mode this only advances the clock; the factor given to
+// set_trail() applies.
 void fade(double f) {
-        canvas.fade(f);
+        flush();
+        if (trail != NULL)
+                trail->advance();
+        else
+                canvas.fade(f);
+}
+
+// Switches to lazily faded trails with factor f per fade() call, or back to
+// eager fading when f is 0. Covers draw() and the span fills; the canvas
+// starts black.
+void set_trail(double f) {
+        flush();
+        delete trail;
+        trail = f > 0 ? new Trail(width(), height(), f) : NULL;
+        canvas.fill(Color::black);
 }
 
 void single_erase(int y, int x) {
-        try {
-                canvas.at(x, y) = background;
-        } catch(int e) {}
+        if (deferred())
+                commands->point(y, x, background);
+        else if (canvas.inside(x, y))
+                canvas.pixel(x, y) = background;
+}
+
+// Lines in the selected color. Outside trail mode the pixel write is
+// inlined into the walk; the trail needs every pixel to go through draw().
+void line(int x1, int y1, int x2, int y2) {
+        if (deferred())
+                commands->line(x1, y1, x2, y2, selected);
+        else if (trail != NULL)
+                line(x1, y1, x2, y2, &Canvas::draw);
+        else
+                raster::line(canvas.view(), bounds(), x1, y1, x2, y2, raster::Set{selected});
 }
 
-void bresenham_same_delta(int x1, int y1,
-                          int x2, int y2, void (Canvas::*action)(int, int)) {
-        if (x1 > x2) { swap(x1, x2); swap(y1, y2); }
-        int step = (y1 < y2 ? 1 : -1);
-        for (; x1 <= x2; x1++, y1 += step) {
-                (this->*action)(x1, y1);
+// Erases the pixels of the line, like calling single_erase on each.
+void erase_line(int x1, int y1, int x2, int y2) {
+        if (deferred()) {
+                commands->line(x1, y1, x2, y2, background);
+                return;
         }
+        raster::line(canvas.view(), bounds(), x1, y1, x2, y2, raster::Set{background});
 }
 
-void bresenham_delta_0(int i, int j,
-                       int x, bool invert, void (Canvas::*action)(int, int)) {
-        if (i > j)
-                swap(i, j);
-        for (; i <= j; i++)
-                invert ? (this->*action)(x, i) : (this->*action)(i, x);
+// Draws the line through any raster:: pixel operation.
+template<class Op>
+void line_with(int x1, int y1, int x2, int y2, Op op) {
+        flush();
+        raster::line(canvas.view(), bounds(), x1, y1, x2, y2, op);
 }
 
+// Calls action(x, y) on every pixel of the line, for actions that are not
+// a single pixel write, such as erase().
 void line(int x1, int y1,
-          int x2, int y2, void (Canvas::*action)(int, int) = &Canvas::draw) {
-        int dx = abs(x2 - x1);
-        int dy = abs(y2 - y1);
-        if (dy == 0) {
-                bresenham_delta_0(x1, x2, y1, false, action);
-        } else if (dx == 0) {
-                bresenham_delta_0(y1, y2, x1, true, action);
-        } else if (dx == dy) {
-                bresenham_same_delta(x1, y1, x2, y2, action);
-        } else if (dy < dx) {
-                if (x1 > x2) {
-                        swap(x1, x2);
-                        swap(y1, y2);
-                }
-                int x = x1, y = y1;
-                int incremento = (y1 < y2 ? 1 : -1);
-                int p = 0;
-                p = 2 * dy - dx;
-                while (x != x2 || y != y2) {
-                        (this->*action)(x, y);
-                        if (p >= 0) {
-                                x++;
-                                y += incremento;
-                                p = p + 2 * dy - 2 * dx;
-                        } else {
-                                x++;
-                                p = p + 2 * dy;
-                        }
-                }
-        } else {
-                if (y1 > y2) {
-                        swap(x1, x2);
-                        swap(y1, y2);
-                }
-                int y = y1, x = x1;
-                int incremento = (x1 < x2 ? 1 : -1);
-                int p = 0;
-                p = 2 * dx - dy;
-                while (y != y2 || x != x2) {
-                        (this->*action)(x, y);
-                        if (p > 0) {
-                                y++;
-                                x += incremento;
-                                p = p + 2 * dx - 2 * dy;
-                        } else {
-                                y++;
-                                p = p + 2 * dx;
-                        }
+          int x2, int y2, void (Canvas::*action)(int, int)) {
+        LineSpan l = clip_line(bounds(), x1, y1, x2, y2);
+        for (int n = 0; n < l.count; n++) {
+                if (l.steep)
+                        (this->*action)(l.v, l.u);
+                else
+                        (this->*action)(l.u, l.v);
+                l.u++;
+                l.r += l.a;
+                if (l.r >= l.c) {
+                        l.r -= l.c;
+                        l.v += l.step;
                 }
         }
-        (this->*action)(x2, y2);
 }
 
 void rectangle(int x1, int y1, int x2, int y2) {
@@ -146,46 +194,210 @@ void rectangle(int x1, int y1, int x2, int y2) {
         line(x2, y1, x2, y2);
 }
 
-void filled_rectangle(int x1, int y1, int x2, int y2) {
-        if(x1 > x2) {
+// Fills columns [x1, x2] of row y with the selected color.
+void span(int y, int x1, int x2) {
+        if (y < 0 || y >= height())
+                return;
+        if (x1 > x2)
                 swap(x1, x2);
+        if (deferred()) {
+                commands->rect(x1, y, x2, y, selected);
+                return;
         }
-        for (; x1 <= x2; x1++) {
-                line(x1, y1, x1, y2);
+        x1 = std::max(x1, 0);
+        x2 = std::min(x2, width() - 1);
+        if (trail != NULL) {
+                for (int x = x1; x <= x2; x++)
+                        trail->plot(y, x, selected);
+        } else if (x1 <= x2) {
+                canvas.fill_row(y, x1, x2, selected);
         }
 }
 
-void fill(int x, int y) {
-        if (canvas.at(y, x) == selected)
+void filled_rectangle(int x1, int y1, int x2, int y2) {
+        if (deferred()) {
+                commands->rect(x1, y1, x2, y2, selected);
+                return;
+        }
+        Rect r = make_rect(x1, y1, x2, y2).intersect(bounds());
+        if (r.empty())
+                return;
+        if (trail != NULL) {
+                for (int y = r.y0; y <= r.y1; y++)
+                        span(y, r.x0, r.x1);
+                return;
+        }
+        canvas.fill_row(r.y0, r.x0, r.x1, selected);
+        const Color *first = canvas.row(r.y0) + r.x0;
+        for (int y = r.y0 + 1; y <= r.y1; y++)
+                memcpy(canvas.row(y) + r.x0, first, r.width() * sizeof(Color));
+}
+
+// Same outline as circle(), filled one row span at a time.
+void filled_circle(int h, int k, int r) {
+        if (r < 0 || outside(h, k, r, r))
+                return;
+        std::vector<int> reach(r + 1, -1);
+        int x = 0, y = r;
+        double p = 1 - r;
+        reach[y] = std::max(reach[y], x);
+        reach[x] = std::max(reach[x], y);
+        while (x < y) {
+                x++;
+                if (p < 0) {
+                        p += 2 * x + 1;
+                } else {
+                        y--;
+                        p += 2 * (x - y) + 1;
+                }
+                reach[y] = std::max(reach[y], x);
+                reach[x] = std::max(reach[x], y);
+        }
+        for (int dy = 0; dy <= r; dy++) {
+                span(k + dy, h - reach[dy], h + reach[dy]);
+                if (dy != 0)
+                        span(k - dy, h - reach[dy], h + reach[dy]);
+        }
+}
+
+// Same outline as ellipse(), filled one row span at a time.
+void filled_ellipse(int h, int k, double a, double b) {
+        if (b < 0 || outside(h, k, ceil(a) + 1, ceil(b)))
                 return;
+        int x = 0;
+        int y = b;
+        std::vector<int> reach(y + 1, 0);
+        int p;
+        double a2 = square(a), b2 = square(b);
+        p = b2 - a2 * b + 0.25 * a2;
+        while (x * b2  < y * a2) {
+                if (p < 0) {
+                        p = p + 2 * x * b2 + b2;
+                } else {
+                        y--;
+                        p = p + 2 * x * b2 + b2 - 2 * y * a2;
+                }
+                x++;
+                reach[y] = std::max(reach[y], x);
+        }
+        p = b2 * square(x + 0.5) + a2 * square(y - 1) - a2 * b2;
+        while (y > 0) {
+                if (p > 0) {
+                        y--;
+                        p = p - 2 * a2 * y + a2;
+                } else {
+                        x++;
+                        y--;
+                        p = p + 2 * b2 * x - 2 * a2 * y + a2;
+                }
+                reach[y] = std::max(reach[y], x);
+        }
+        for (int dy = 0; dy < static_cast<int>(reach.size()); dy++) {
+                span(k + dy, h - reach[dy], h + reach[dy]);
+                if (dy != 0)
+                        span(k - dy, h - reach[dy], h + reach[dy]);
+        }
+}
 
-        Color target = canvas.at(y, x);
+// Even-odd scanline fill. A row is crossed by the edges that start at or
+// below it and end above it, and pixels between crossing pairs are filled.
+void filled_polygon(const std::vector<std::pair<int, int>>& points) {
+        if (points.size() < 3)
+                return;
+        int lo = points[0].second, hi = lo;
+        for (auto& q : points) {
+                lo = std::min(lo, q.second);
+                hi = std::max(hi, q.second);
+        }
+        lo = std::max(lo, 0);
+        hi = std::min(hi, height() - 1);
+        std::vector<double> cross;
+        for (int y = lo; y <= hi; y++) {
+                cross.clear();
+                for (size_t i = 0; i < points.size(); i++) {
+                        auto a = points[i];
+                        auto b = points[(i + 1) % points.size()];
+                        if (a.second > b.second)
+                                swap(a, b);
+                        if (a.second <= y && y < b.second)
+                                cross.push_back(a.first + double(y - a.second) * (b.first - a.first) / (b.second - a.second));
+                }
+                std::sort(cross.begin(), cross.end());
+                for (size_t i = 0; i + 1 < cross.size(); i += 2) {
+                        int x1 = ceil(cross[i]), x2 = floor(cross[i + 1]);
+                        if (x1 <= x2)
+                                span(y, x1, x2);
+                }
+        }
+}
 
-        int dx[] = {1, -1, 0, 0};
-        int dy[] = {0, 0, 1, -1};
-        draw(x, y);
-        std::stack<int> stack;
-        stack.push(x);
-        stack.push(y);
+// Regular polygon with the same vertices as polygon().
+void filled_polygon(int x, int y, int r, double ang, int l) {
+        std::vector<std::pair<int, int>> points;
+        for (int i = 0; i < l; i++) {
+                points.push_back({static_cast<int>(floor(r * cos(i * (2.0 * M_PI / l) + ang))) + x,
+                                  static_cast<int>(floor(r * sin(i * (2.0 * M_PI / l) + ang))) + y});
+        }
+        filled_polygon(points);
+}
 
+// Scanline flood fill of the 4-connected region of the color under (x, y).
+// Each stack entry is a run already filled on row y - dy whose neighbours on
+// row y are still to be scanned; whole runs are found and filled at once,
+// and runs that stick out past their parent are also sent back the other
+// way (Heckbert's seed fill). The canvas is written even in trail mode, as
+// it is what tells filled pixels apart.
+void fill(int x, int y) {
+        flush();
+        if (!canvas.inside(y, x) || canvas.pixel(y, x) == selected)
+                return;
+        Color target = canvas.pixel(y, x);
+        struct Segment {
+                int y, x1, x2, dy;
+        };
+        std::vector<Segment> stack;
+        auto push = [&](int y, int x1, int x2, int dy) {
+                if (y + dy >= 0 && y + dy < height())
+                        stack.push_back(Segment{y, x1, x2, dy});
+        };
+        push(y, x, x, 1);
+        push(y + 1, x, x, -1);
+        int last = width() - 1;
         while (!stack.empty()) {
-                y = stack.top(); stack.pop();
-                x = stack.top(); stack.pop();
-                for (int i = 0; i < 4; i++) {
-                        int x2 = x + dx[i];
-                        int y2 = y + dy[i];
-                        try {
-                                if (canvas.at(y2, x2) == target) {
-                                        draw(x2, y2);
-                                        stack.push(x2);
-                                        stack.push(y2);
-                                }
-                        } catch (int e) {}
+                Segment s = stack.back();
+                stack.pop_back();
+                int row = s.y + s.dy;
+                const Color *p = canvas.row(row);
+                int l = s.x1;
+                if (p[l] == target) {
+                        while (l > 0 && p[l - 1] == target)
+                                l--;
+                } else {
+                        while (l <= s.x2 && !(p[l] == target))
+                                l++;
+                }
+                while (l <= s.x2) {
+                        int r = l;
+                        while (r < last && p[r + 1] == target)
+                                r++;
+                        canvas.fill_row(row, l, r, selected);
+                        if (trail != NULL)
+                                for (int j = l; j <= r; j++)
+                                        trail->plot(row, j, selected);
+                        push(row, l, r, s.dy);
+                        if (l < s.x1)
+                                push(row, l, s.x1 - 1, -s.dy);
+                        if (r > s.x2)
+                                push(row, s.x2 + 1, r, -s.dy);
+                        for (l = r + 2; l <= s.x2 && !(p[l] == target); l++) {}
                 }
         }
 }
 
 void ellipse(int h, int k, double a, double b) {
+        // The second region can step one pixel past a horizontally.
+        if (outside(h, k, ceil(a) + 1, ceil(b)))
+                return;
         int x = 0;
         int y = b;
         int p;
@@ -228,6 +440,11 @@ void ellipse(int h, int k, double a, double b) {
         }
 }
 
+// True when the box of half-size (a, b) around (h, k) misses the canvas.
+bool outside(int h, int k, int a, int b) const {
+        return Rect{h - a, k - b, h + a, k + b}.intersect(bounds()).empty();
+}
+
 void polygon(int x, int y, int r, double ang, int l) {
         int h, k;
         int p, q;
@@ -254,6 +471,8 @@ void circle_points(int h, int k, int x, int y) {
 }
 
 void circle(int h, int k, int r) {
+        if (outside(h, k, r, r))
+                return;
         int x, y;
         x = 0;
         y = r;
@@ -328,14 +547,33 @@ void spline_curve(double x1, double y1,
 }
 
 void load_bmp(const char *const name) {
+        flush();
         Image *i = new Image();
         i->load_bmp(name);
         i->draw_at(&canvas, 0, 0);
         delete i;
 }
 
+// Replaces the frame with the colors of an indexed framebuffer.
+void draw_indexed(const IndexedImage& frame) {
+        flush();
+        frame.expand(canvas.view());
+}
+
+// Replaces the frame with the density view of the particles binned in s.
+void draw_splat(Splat& s) {
+        flush();
+        s.resolve(canvas.view());
+}
+
 void save_bmp(const char *const name) {
+        flush();
         canvas.save_bmp(name);
 }
+
+void save_qoi(const char *const name) {
+        flush();
+        canvas.save_qoi(name);
+}
 };
 #endif  // CANVAS_H_
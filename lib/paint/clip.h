@@ -0,0 +1,149 @@
+// Copyright Tacho 2021
+
+#ifndef CLIP_H_
+#define CLIP_H_
+
+#include <algorithm>
+#include <cstdlib>
+
+// Inclusive pixel rectangle, x along columns and y along rows.
+struct Rect {
+        int x0, y0, x1, y1;
+
+        bool empty() const {
+                return x0 > x1 || y0 > y1;
+        }
+
+        bool contains(int x, int y) const {
+                return x0 <= x && x <= x1 && y0 <= y && y <= y1;
+        }
+
+        Rect intersect(const Rect& o) const {
+                return Rect{std::max(x0, o.x0), std::max(y0, o.y0),
+                            std::min(x1, o.x1), std::min(y1, o.y1)};
+        }
+
+        int width() const {
+                return x1 - x0 + 1;
+        }
+
+        int height() const {
+                return y1 - y0 + 1;
+        }
+};
+
+// Builds a rectangle from two corners given in any order.
+inline Rect make_rect(int x1, int y1, int x2, int y2) {
+        return Rect{std::min(x1, x2), std::min(y1, y2),
+                    std::max(x1, x2), std::max(y1, y2)};
+}
+
+// Cohen-Sutherland region codes.
+enum {
+        CLIP_INSIDE = 0,
+        CLIP_LEFT = 1,
+        CLIP_RIGHT = 2,
+        CLIP_BOTTOM = 4,
+        CLIP_TOP = 8
+};
+
+inline int outcode(const Rect& r, int x, int y) {
+        int code = CLIP_INSIDE;
+        if (x < r.x0)
+                code |= CLIP_LEFT;
+        else if (x > r.x1)
+                code |= CLIP_RIGHT;
+        if (y < r.y0)
+                code |= CLIP_BOTTOM;
+        else if (y > r.y1)
+                code |= CLIP_TOP;
+        return code;
+}
+
+inline long long floor_div(long long a, long long b) {
+        long long q = a / b;
+        return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+inline long long ceil_div(long long a, long long b) {
+        return -floor_div(-a, b);
+}
+
+// A Bresenham line walked along its major axis u, with the minor axis v
+// advancing by `step` after k(i) = floor((a * i + b) / c) of the first i
+// steps. Describing the line in closed form lets it be clipped exactly: the
+// pixels kept are the same ones the unclipped walk would have produced.
+struct LineSpan {
+        int u, v;       // first visible pixel
+        int step;       // +1 or -1 along v
+        int count;      // visible pixels, 0 when fully clipped
+        long long a, c; // error increment and modulus
+        long long r;    // error accumulator at the first pixel
+        bool steep;     // u is y when true
+};
+
+// Clips the line (x1, y1)-(x2, y2) against r, following the walk of the
+// original Canvas::line: x-major lines start from the left end and step v
+// when the error is >= 0, y-major ones start from the bottom end and step
+// when it is > 0.
+inline LineSpan clip_line(const Rect& r, int x1, int y1, int x2, int y2) {
+        LineSpan s;
+        s.count = 0;
+        if (outcode(r, x1, y1) & outcode(r, x2, y2))
+                return s;
+
+        int dx = std::abs(x2 - x1);
+        int dy = std::abs(y2 - y1);
+        s.steep = dy > dx;
+        int u1, v1, u2, v2, umin, umax, vmin, vmax;
+        if (s.steep) {
+                if (y1 > y2) {
+                        std::swap(x1, x2);
+                        std::swap(y1, y2);
+                }
+                u1 = y1; v1 = x1; u2 = y2; v2 = x2;
+                umin = r.y0; umax = r.y1; vmin = r.x0; vmax = r.x1;
+        } else {
+                if (x1 > x2) {
+                        std::swap(x1, x2);
+                        std::swap(y1, y2);
+                }
+                u1 = x1; v1 = y1; u2 = x2; v2 = y2;
+                umin = r.x0; umax = r.x1; vmin = r.y0; vmax = r.y1;
+        }
+        long long n = u2 - u1;
+        s.step = v1 < v2 ? 1 : -1;
+        s.a = 2LL * std::abs(v2 - v1);
+        s.c = std::max(2 * n, 1LL);
+        long long b = s.steep ? n - 1 : n;
+
+        long long lo = std::max(0LL, (long long)umin - u1);
+        long long hi = std::min(n, (long long)umax - u1);
+        long long klo, khi;
+        if (s.step > 0) {
+                klo = vmin - v1;
+                khi = vmax - v1;
+        } else {
+                klo = v1 - vmax;
+                khi = v1 - vmin;
+        }
+        if (s.a == 0) {
+                if (klo > 0 || khi < 0)
+                        return s;
+        } else {
+                lo = std::max(lo, ceil_div(s.c * klo - b, s.a));
+                hi = std::min(hi, floor_div(s.c * (khi + 1) - b - 1, s.a));
+        }
+        if (lo > hi)
+                return s;
+
+        long long t = s.a * lo + b;
+        long long k = floor_div(t, s.c);
+        s.r = t - k * s.c;
+        s.u = u1 + lo;
+        s.v = v1 + s.step * k;
+        s.count = hi - lo + 1;
+        return s;
+}
+
+#endif  // CLIP_H_
@@ -1,45 +1,75 @@
 // Copyright Tacho 2021
 #ifndef LIB_COLOR_H_
 #define LIB_COLOR_H_
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <cmath>
 
-class Color {
+// RGBA8, one aligned 32-bit word per pixel so that frame loops move whole
+// pixels with plain vector loads and stores. Alpha is always 255: nothing
+// blends by it, it only pads the pixel to four bytes, and keeping it fixed
+// is what lets == and the saturating operators work on the whole word.
+class alignas(4) Color {
 public:
 unsigned char r;
 unsigned char g;
 unsigned char b;
+unsigned char a;
 
-Color() {
-        r = g = b = 0;
+constexpr Color() : r(0), g(0), b(0), a(255) {}
+
+constexpr Color(int x, int y, int z)
+        : r(clamp(x)), g(clamp(y)), b(clamp(z)), a(255) {}
+
+static constexpr unsigned char clamp(int v) {
+        return v < 0 ? 0 : (v > 255 ? 255 : v);
 }
 
-Color(int x, int y, int z) {
-        r = std::min(255, std::max(0, x));
-        g = std::min(255, std::max(0, y));
-        b = std::min(255, std::max(0, z));
+uint32_t word() const {
+        uint32_t w;
+        memcpy(&w, this, sizeof(w));
+        return w;
 }
 
-Color operator+(const Color& o) {
-        int rn = r + o.r;
-        int gn = g + o.g;
-        int bn = b + o.b;
-        return Color(rn, gn, bn);
+static Color from_word(uint32_t w) {
+        Color c;
+        memcpy(static_cast<void*>(&c), &w, sizeof(c));
+        return c;
+}
+
+// Per-channel min(x + y, 255), four bytes at once: the low seven bits of
+// every byte are added without carrying into the next byte, and the carry
+// out of bit seven becomes a byte mask that saturates it.
+Color operator+(const Color& o) const {
+        const uint32_t L = 0x7f7f7f7f, H = 0x80808080;
+        uint32_t x = word(), y = o.word();
+        uint32_t low = (x & L) + (y & L);
+        uint32_t carry = ((x & y) | ((x | y) & low)) & H;
+        return from_word((low ^ ((x ^ y) & H)) | ((carry >> 7) * 0xff));
 }
 
+// Wraps around per channel, like the unsigned char sums it replaces.
 Color operator+=(const Color& o) {
-        r += o.r;
-        g += o.g;
-        b += o.b;
+        const uint32_t L = 0x7f7f7f7f, H = 0x80808080;
+        uint32_t x = word(), y = o.word();
+        *this = from_word(((x & L) + (y & L)) ^ ((x ^ y) & H));
+        a = 255;
         return *this;
 }
 
+// Per-channel max(x - y, 0): the low seven bits are subtracted from x with
+// bit seven forced on, so no byte borrows from the next one, and the
+// borrow out of bit seven becomes a byte mask that clears it.
 Color operator-(const Color& o) const {
-        int rn = r - o.r;
-        int gn = g - o.g;
-        int bn = b - o.b;
-        return Color(rn, gn, bn);
+        const uint32_t L = 0x7f7f7f7f, H = 0x80808080;
+        uint32_t x = word(), y = o.word();
+        uint32_t low = (x | H) - (y & L);
+        uint32_t borrow = ((~x & y) | (~(x ^ y) & ~low)) & H;
+        Color c = from_word((low ^ ((x ^ ~y) & H)) & ~((borrow >> 7) * 0xff));
+        c.a = 255;
+        return c;
 }
 
 std::string to_string() const {
@@ -48,11 +78,11 @@ std::string to_string() const {
 }
 
 inline bool operator==(Color o) const {
-        return r == o.r && g == o.g && b == o.b;
+        return word() == o.word();
 }
 
-inline bool operator!=(Color o) {
-        return r != o.r && g != o.g && b != o.b;
+inline bool operator!=(Color o) const {
+        return word() != o.word();
 }
 
 Color operator*(double s) const {
@@ -62,14 +92,14 @@ Color operator*(double s) const {
         return Color(rn, gn, bn);
 }
 
-Color to_gray() {
+Color to_gray() const {
         int c;
         c = 0.30 * r + 0.59 * g + 0.11 * b;
         return Color(c, c, c);
 }
 
 
-unsigned char light() {
+unsigned char light() const {
         return (unsigned char)(0.30 * r + 0.59 * g + 0.11 * b);
 }
 
@@ -81,12 +111,14 @@ static const Color red;
 static const Color yellow;
 };
 
-const Color Color::white = Color(255, 255, 255);
-const Color Color::black = Color(0, 0, 0);
-const Color Color::green = Color(0, 255, 0);
-const Color Color::blue = Color(0, 0, 255);
-const Color Color::red = Color(255, 0, 0);
-const Color Color::yellow = Color(255, 255, 0);
+static_assert(sizeof(Color) == 4 && alignof(Color) == 4, "pixels are one 32-bit word");
+
+constexpr Color Color::white = Color(255, 255, 255);
+constexpr Color Color::black = Color(0, 0, 0);
+constexpr Color Color::green = Color(0, 255, 0);
+constexpr Color Color::blue = Color(0, 0, 255);
+constexpr Color Color::red = Color(255, 0, 0);
+constexpr Color Color::yellow = Color(255, 255, 0);
 
 std::istream& operator>>(std::istream& s, Color& c) {
         if (&s == &std::cin) {
@@ -139,25 +171,44 @@ Color absdif(Color a, Color b) {
 }
 
 
-Color hsl(int angle) {
-        angle = (angle % 360 + 360) % 360;
-        double hue = floor(255 * static_cast<double>(angle % 60) / 60.0);
-        double hue_compliment = 255.0 - hue;
-        switch (angle / 60 % 6) {
-        case 0:
-                return Color(255, hue, 0);
-        case 1:
-                return Color(hue_compliment, 255, 0);
-        case 2:
-                return Color(0, 255, hue);
-        case 3:
-                return Color(0, hue_compliment, 255);
-        case 4:
-                return Color(hue, 0, 255);
-        case 5:
-                return Color(255, 0, hue_compliment);
+// hsl() for every whole degree, built by the compiler. The ramp is
+// 255 * (angle % 60) / 60 rounded down, as the old floating-point version
+// computed it.
+struct HueTable {
+        Color colors[360];
+
+        constexpr HueTable() : colors() {
+                for (int angle = 0; angle < 360; angle++) {
+                        int hue = 255 * (angle % 60) / 60;
+                        int hue_compliment = 255 - hue;
+                        switch (angle / 60) {
+                        case 0:
+                                colors[angle] = Color(255, hue, 0);
+                                break;
+                        case 1:
+                                colors[angle] = Color(hue_compliment, 255, 0);
+                                break;
+                        case 2:
+                                colors[angle] = Color(0, 255, hue);
+                                break;
+                        case 3:
+                                colors[angle] = Color(0, hue_compliment, 255);
+                                break;
+                        case 4:
+                                colors[angle] = Color(hue, 0, 255);
+                                break;
+                        default:
+                                colors[angle] = Color(255, 0, hue_compliment);
+                                break;
+                        }
+                }
         }
-        return Color::black; // this block is unreacheable
+};
+
+constexpr HueTable HUES;
+
+Color hsl(int angle) {
+        return HUES.colors[(angle % 360 + 360) % 360];
 }
 
 #ifdef GL_UNSIGNED_BYTE
@@ -0,0 +1,120 @@
+// Copyright Tacho 2021
+
+#ifndef COMMANDS_H_
+#define COMMANDS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "clip.h"
+#include "color.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "raster.h"
+#include "view.h"
+
+// Draw commands recorded now and rasterized later. execute() sorts the
+// commands into TILE x TILE screen tiles and rasterizes every tile on a
+// worker thread, clipped to the tile, so threads never write the same
+// pixel and need no locks. Within a tile commands run in the order they
+// were recorded, which is all that ordering can affect.
+class CommandList {
+public:
+static const int TILE = 64;
+
+private:
+enum Kind : uint8_t {
+        POINT,
+        LINE,
+        RECT
+};
+
+// x along columns, y along rows, as everywhere in the canvas. The kind
+// takes the place of the color's alpha, which is always 255.
+struct Command {
+        int x1, y1, x2, y2;
+        uint8_t r, g, b;
+        Kind kind;
+
+        Color color() const {
+                return Color(r, g, b);
+        }
+};
+
+static_assert(sizeof(Command) == 20, "commands are 20 bytes");
+
+std::vector<Command> commands_;
+std::vector<std::vector<uint32_t>> bins_;
+
+static void run(const Command& c, ImageView img, const Rect& clip) {
+        switch (c.kind) {
+        case POINT:
+                if (clip.contains(c.x1, c.y1))
+                        img.pixel(c.y1, c.x1) = c.color();
+                break;
+        case LINE:
+                raster::line(img, clip, c.x1, c.y1, c.x2, c.y2, raster::Set{c.color()});
+                break;
+        case RECT: {
+                Rect r = Rect{c.x1, c.y1, c.x2, c.y2}.intersect(clip);
+                for (int y = r.y0; y <= r.y1; y++)
+                        kernels::fill(img.row(y) + r.x0, r.width(), c.color());
+                break;
+        }
+        }
+}
+
+public:
+size_t size() const {
+        return commands_.size();
+}
+
+bool empty() const {
+        return commands_.empty();
+}
+
+void point(int x, int y, Color c) {
+        commands_.push_back(Command{x, y, x, y, c.r, c.g, c.b, POINT});
+}
+
+void line(int x1, int y1, int x2, int y2, Color c) {
+        commands_.push_back(Command{x1, y1, x2, y2, c.r, c.g, c.b, LINE});
+}
+
+// Filled rectangle, corners in any order.
+void rect(int x1, int y1, int x2, int y2, Color c) {
+        Rect r = make_rect(x1, y1, x2, y2);
+        commands_.push_back(Command{r.x0, r.y0, r.x1, r.y1, c.r, c.g, c.b, RECT});
+}
+
+// Rasterizes and forgets every recorded command.
+void execute(ImageView img) {
+        Rect screen = img.bounds();
+        int tiles_x = (img.width() + TILE - 1) / TILE;
+        int tiles_y = (img.height() + TILE - 1) / TILE;
+        bins_.resize(size_t(tiles_x) * tiles_y);
+        for (auto& bin : bins_)
+                bin.clear();
+        for (uint32_t i = 0; i < commands_.size(); i++) {
+                const Command& c = commands_[i];
+                Rect r = make_rect(c.x1, c.y1, c.x2, c.y2).intersect(screen);
+                if (r.empty())
+                        continue;
+                for (int ty = r.y0 / TILE; ty <= r.y1 / TILE; ty++)
+                        for (int tx = r.x0 / TILE; tx <= r.x1 / TILE; tx++)
+                                bins_[ty * tiles_x + tx].push_back(i);
+        }
+        parallel_for(tiles_x * tiles_y, 4, [&](int begin, int end) {
+                for (int t = begin; t < end; t++) {
+                        int x0 = t % tiles_x * TILE, y0 = t / tiles_x * TILE;
+                        Rect clip = Rect{x0, y0, x0 + TILE - 1, y0 + TILE - 1}.intersect(screen);
+                        for (uint32_t i : bins_[t])
+                                run(commands_[i], img, clip);
+                }
+        });
+        commands_.clear();
+}
+};
+
+#endif  // COMMANDS_H_
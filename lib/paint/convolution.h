@@ -0,0 +1,180 @@
+// Copyright Tacho 2021
+
+#ifndef CONVOLUTION_H_
+#define CONVOLUTION_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "color.h"
+#include "kernels.h"
+#include "parallel.h"
+
+// A convolution kernel of odd size, centered on its middle element and
+// applied as a correlation (not flipped), like Image::matrix_filter.
+class Kernel {
+public:
+int width, height;
+std::vector<float> weights;  // row-major, height x width
+
+Kernel(int w, int h, const double *values) : width(w), height(h), weights(w * h) {
+        for (int i = 0; i < w * h; i++)
+                weights[i] = values[i];
+}
+
+Kernel(int w, int h) : width(w), height(h), weights(w * h, 0.0f) {}
+
+float at(int i, int j) const {
+        return weights[i * width + j];
+}
+
+// Outer product column * row.
+static Kernel separable(const std::vector<float>& column, const std::vector<float>& row) {
+        Kernel k(row.size(), column.size());
+        for (int i = 0; i < k.height; i++)
+                for (int j = 0; j < k.width; j++)
+                        k.weights[i * k.width + j] = column[i] * row[j];
+        return k;
+}
+
+static Kernel box(int radius) {
+        std::vector<float> v(2 * radius + 1, 1.0f / (2 * radius + 1));
+        return separable(v, v);
+}
+
+static Kernel gaussian(int radius, double sigma) {
+        std::vector<float> v(2 * radius + 1);
+        double sum = 0;
+        for (int i = -radius; i <= radius; i++)
+                sum += v[i + radius] = exp(-i * i / (2 * sigma * sigma));
+        for (auto& x : v)
+                x /= sum;
+        return separable(v, v);
+}
+
+// Splits the kernel into column * row when it has rank one. The row is the
+// one holding the largest weight and the column is scaled to match.
+bool factor(std::vector<float>& column, std::vector<float>& row) const {
+        int pi = 0, pj = 0;
+        float big = 0;
+        for (int i = 0; i < height; i++)
+                for (int j = 0; j < width; j++)
+                        if (std::abs(at(i, j)) > big) {
+                                big = std::abs(at(i, j));
+                                pi = i;
+                                pj = j;
+                        }
+        if (big == 0)
+                return false;
+        row.assign(weights.begin() + pi * width, weights.begin() + (pi + 1) * width);
+        column.resize(height);
+        for (int i = 0; i < height; i++)
+                column[i] = at(i, pj) / at(pi, pj);
+        for (int i = 0; i < height; i++)
+                for (int j = 0; j < width; j++)
+                        if (std::abs(column[i] * row[j] - at(i, j)) > 1e-6f * big)
+                                return false;
+        return true;
+}
+};
+
+namespace convolution {
+
+const int TILE_ROWS = 64;
+const int TILE_COLS = 256;
+
+// Rows are padded to whole vectors of four floats.
+const int LANES = 4;
+// Floats per pixel. Alpha is carried along as a fourth channel so that a
+// pixel is exactly one vector; store_row() writes it back as 255.
+const int CHANNELS = sizeof(Color);
+
+inline int round_up(int n) {
+        return (n + LANES - 1) / LANES * LANES;
+}
+
+// Converts a tile of pixels into floats, with `pad` zero pixels
+// on each side horizontally and `vpad` zero rows above and below, so the
+// inner loops never look at the image border. Rows are `line` floats apart.
+inline void load_tile(const Color *src, int stride, int w, int h,
+                      int y0, int x0, int rows, int cols, int vpad, int pad,
+                      int line, std::vector<float>& out) {
+        out.assign(size_t(rows + 2 * vpad) * line, 0.0f);
+        int c0 = std::max(0, x0 - pad), c1 = std::min(w, x0 + cols + pad);
+        for (int r = 0; r < rows + 2 * vpad; r++) {
+                int y = y0 - vpad + r;
+                if (y < 0 || y >= h)
+                        continue;
+                const unsigned char *s = reinterpret_cast<const unsigned char*>(src + size_t(y) * stride + c0);
+                float *d = &out[size_t(r) * line + (c0 - (x0 - pad)) * CHANNELS];
+                for (int k = 0; k < (c1 - c0) * CHANNELS; k++)
+                        d[k] = s[k];
+        }
+}
+
+// Truncates toward zero and clamps, like the Color(int, int, int) the old
+// filter built from doubles.
+inline void store_row(const float *in, Color *dst, int cols) {
+        for (int j = 0; j < cols; j++, in += CHANNELS)
+                dst[j] = Color(static_cast<int>(in[0]), static_cast<int>(in[1]), static_cast<int>(in[2]));
+}
+
+// out[t] += sum_b k[b] * in[t + CHANNELS b]: one kernel row along
+// interleaved channels, one kernels::axpy per tap.
+// `in` is readable n floats past each tap.
+inline void accumulate_row(const float *in, const float *k, int taps, float *out, int n) {
+        for (int b = 0; b < taps; b++) {
+                if (k[b] != 0)
+                        kernels::axpy(out, in + CHANNELS * b, k[b], n);
+        }
+}
+
+// Convolves a w x h image into dst (same size, may not alias src). Work is
+// split into TILE_ROWS x TILE_COLS tiles spread over worker threads. Rank-one
+// kernels run as a horizontal pass followed by a vertical one.
+inline void apply(const Color *src, int src_stride, Color *dst, int dst_stride,
+                  int w, int h, const Kernel& k) {
+        int rx = k.width / 2, ry = k.height / 2;
+        std::vector<float> column, row;
+        bool split = k.factor(column, row);
+        int tiles_x = (w + TILE_COLS - 1) / TILE_COLS;
+        int tiles_y = (h + TILE_ROWS - 1) / TILE_ROWS;
+
+        parallel_for(tiles_x * tiles_y, 1, [&](int begin, int end) {
+                std::vector<float> in, mid, acc;
+                for (int t = begin; t < end; t++) {
+                        int y0 = t / tiles_x * TILE_ROWS, x0 = t % tiles_x * TILE_COLS;
+                        int rows = std::min(TILE_ROWS, h - y0);
+                        int cols = std::min(TILE_COLS, w - x0);
+                        int n = round_up(cols * CHANNELS);
+                        int line = round_up(n + 2 * CHANNELS * rx);
+                        load_tile(src, src_stride, w, h, y0, x0, rows, cols, ry, rx, line, in);
+                        acc.resize(n);
+                        if (split) {
+                                mid.assign(size_t(rows + 2 * ry) * n, 0.0f);
+                                for (int r = 0; r < rows + 2 * ry; r++)
+                                        accumulate_row(&in[size_t(r) * line], row.data(), k.width,
+                                                       &mid[size_t(r) * n], n);
+                                for (int r = 0; r < rows; r++) {
+                                        std::fill(acc.begin(), acc.end(), 0.0f);
+                                        for (int a = 0; a < k.height; a++)
+                                                kernels::axpy(acc.data(), &mid[size_t(r + a) * n], column[a], n);
+                                        store_row(acc.data(), dst + size_t(y0 + r) * dst_stride + x0, cols);
+                                }
+                        } else {
+                                for (int r = 0; r < rows; r++) {
+                                        std::fill(acc.begin(), acc.end(), 0.0f);
+                                        for (int a = 0; a < k.height; a++)
+                                                accumulate_row(&in[size_t(r + a) * line], &k.weights[a * k.width],
+                                                               k.width, acc.data(), n);
+                                        store_row(acc.data(), dst + size_t(y0 + r) * dst_stride + x0, cols);
+                                }
+                        }
+                }
+        });
+}
+
+}  // namespace convolution
+
+#endif  // CONVOLUTION_H_
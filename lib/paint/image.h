@@ -3,76 +3,262 @@
 #ifndef IMAGE_H_
 #define IMAGE_H_
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
+#include <fstream>
+#include <iostream>
 #include <iterator>
+#include <new>
+#include <vector>
 
+#include "clip.h"
 #include "color.h"
-
+#include "convolution.h"
+#include "kernels.h"
+#include "qoi.h"
+#include "view.h"
+
+// Pixels are stored row by row. Every row starts on a 64-byte boundary, so
+// rows are padded to stride() pixels; the padding belongs to the image and
+// the whole-buffer kernels run over it too.
 class Image {
 private:
 Color *pixels;
 int width_, height_;
+int stride_;
+
+static const int ALIGNMENT = 64;
+static const int ROW_PIXELS = ALIGNMENT / sizeof(Color);
+
+void allocate(int w, int h) {
+        width_ = w;
+        height_ = h;
+        stride_ = (w + ROW_PIXELS - 1) / ROW_PIXELS * ROW_PIXELS;
+        size_t n = size_bytes();
+        pixels = n == 0 ? NULL : static_cast<Color*>(std::aligned_alloc(ALIGNMENT, n));
+        if (n != 0 && pixels == NULL)
+                throw std::bad_alloc();
+}
+
+void release() {
+        free(pixels);
+        pixels = NULL;
+        width_ = height_ = stride_ = 0;
+}
+
+// Discards the pixels and allocates a w x h image, left uninitialized.
+void reset(int w, int h) {
+        release();
+        allocate(w, h);
+}
+
+public:
+// Walks the pixels in row order, skipping the row padding.
+template<class T>
+class basic_iterator {
+private:
+T *p_, *row_end_;
+int width_, pad_;
 
 public:
-typedef Color* iterator;
-typedef const Color* const_iterator;
+typedef std::forward_iterator_tag iterator_category;
+typedef T value_type;
+typedef std::ptrdiff_t difference_type;
+typedef T* pointer;
+typedef T& reference;
+
+basic_iterator(T *p, int width, int stride)
+        : p_(p), row_end_(p + width), width_(width), pad_(stride - width) {}
+
+T& operator*() const {
+        return *p_;
+}
+
+T* operator->() const {
+        return p_;
+}
+
+basic_iterator& operator++() {
+        if (++p_ == row_end_) {
+                p_ += pad_;
+                row_end_ = p_ + width_;
+        }
+        return *this;
+}
+
+basic_iterator operator++(int) {
+        basic_iterator old = *this;
+        ++*this;
+        return old;
+}
+
+bool operator==(const basic_iterator& o) const {
+        return p_ == o.p_;
+}
+
+bool operator!=(const basic_iterator& o) const {
+        return p_ != o.p_;
+}
+};
+
+typedef basic_iterator<Color> iterator;
+typedef basic_iterator<const Color> const_iterator;
+
 iterator begin() {
-        return pixels;
+        return iterator(pixels, width_, stride_);
 }
 
 iterator end() {
-        return &pixels[width_ * height_ - 1];
+        return iterator(row(height_), width_, stride_);
+}
+
+const_iterator begin() const {
+        return const_iterator(pixels, width_, stride_);
+}
+
+const_iterator end() const {
+        return const_iterator(row(height_), width_, stride_);
 }
 
 Image(int w, int h, const Color& def = Color::black) {
-        width_ = w;
-        height_ = h;
-        pixels = new Color[w * h];
-        int j = 0;;
-        for (auto &i : *this) {
-                i = def;
-        }
+        allocate(w, h);
+        fill(def);
 }
 
 Image() {
         pixels = NULL;
-        width_ = height_ = 0;
+        width_ = height_ = stride_ = 0;
 }
 
 Image(const Image &i) {
-        width_ = i.width_;
-        height_ = i.height_;
-        pixels = new Color[width_ * height_];
-        memcpy(pixels, i.pixels, width_ * height_ * sizeof(Color));
+        allocate(i.width_, i.height_);
+        memcpy(pixels, i.pixels, size_bytes());
+}
+
+Image(Image &&i) : pixels(i.pixels), width_(i.width_), height_(i.height_), stride_(i.stride_) {
+        i.pixels = NULL;
+        i.width_ = i.height_ = i.stride_ = 0;
+}
+
+~Image() {
+        free(pixels);
 }
 
-int height() {
+// Copies or moves, depending on how the argument was built.
+Image& operator=(Image i) {
+        std::swap(pixels, i.pixels);
+        std::swap(width_, i.width_);
+        std::swap(height_, i.height_);
+        std::swap(stride_, i.stride_);
+        return *this;
+}
+
+int height() const {
         return height_;
 }
 
-int rows() {
+int rows() const {
         return height_;
 }
 
-int cols() {
+int cols() const {
         return width_;
 }
 
-int width() {
+int width() const {
         return width_;
 }
 
+// Distance between rows, in pixels.
+int stride() const {
+        return stride_;
+}
+
 Color& at(int i, int j) {
         if (i < 0 || i >= height_  || j < 0 || j >= width_)
                 throw 0;
-        return pixels[i * width_ + j];
+        return row(i)[j];
 }
 
 Color at(int i, int j) const {
         if (i < 0 || i >= height_  || j < 0 || j >= width_)
                 throw 0;
-        return pixels[i * width_ + j];
+        return row(i)[j];
+}
+
+bool inside(int i, int j) const {
+        return i >= 0 && i < height_ && j >= 0 && j < width_;
+}
+
+Rect bounds() const {
+        return Rect{0, 0, width_ - 1, height_ - 1};
+}
+
+// Unchecked access, for callers that already clipped against bounds().
+Color* row(int i) {
+        return pixels + size_t(i) * stride_;
+}
+
+const Color* row(int i) const {
+        return pixels + size_t(i) * stride_;
+}
+
+Color& pixel(int i, int j) {
+        return row(i)[j];
+}
+
+Color pixel(int i, int j) const {
+        return row(i)[j];
+}
+
+ImageView view() {
+        return ImageView(pixels, stride_, width_, height_);
+}
+
+ConstImageView view() const {
+        return ConstImageView(pixels, stride_, width_, height_);
+}
+
+// The w x h region with top left corner at column x, row y, clipped
+// against the image. It shares the pixels of this image.
+ImageView view(int x, int y, int w, int h) {
+        return view().sub(Rect{x, y, x + w - 1, y + h - 1});
+}
+
+ConstImageView view(int x, int y, int w, int h) const {
+        return view().sub(Rect{x, y, x + w - 1, y + h - 1});
+}
+
+operator ImageView() {
+        return view();
+}
+
+operator ConstImageView() const {
+        return view();
+}
+
+// Unchecked fill of pixels [j0, j1] of row i.
+void fill_row(int i, int j0, int j1, Color c) {
+        kernels::fill(row(i) + j0, j1 - j0 + 1, c);
+}
+
+// Copies a rows x cols block from src at (si, sj) to dst at (di, dj),
+// clipped against both images.
+static void blit(const Image& src, int si, int sj,
+                 Image& dst, int di, int dj, int rows, int cols) {
+        int skip = std::max({0, -si, -di});
+        si += skip; di += skip; rows -= skip;
+        skip = std::max({0, -sj, -dj});
+        sj += skip; dj += skip; cols -= skip;
+        ::blit(src.view(sj, si, cols, rows), dst.view(), di, dj);
 }
 
 Image gray_scale() {
@@ -135,29 +321,46 @@ Image threshold(unsigned char min, Color down, Color up) {
 }
 
 void copy(const Image &o) {
-        memcpy(pixels, o.pixels, width_ * height_ * sizeof(Color));
+        ::blit(o.view(), view());
 }
 
 void copy(const Image &o, int h, int k) {
-        for (int i = 0; i < o.height_; i++)
-                for (int j = 0; j < o.width_; j++) {
-                        int p, q;
-                        p = h + i;
-                        q = k + j;
-                        try {
-                                at(p, q) = o.at(i, j);
-                        }catch(int e) {}
-                }
+        blit(o, 0, 0, *this, h, k, o.height_, o.width_);
+}
+
+static unsigned char* bytes(Color *p) {
+        return reinterpret_cast<unsigned char*>(p);
+}
+
+static const unsigned char* bytes(const Color *p) {
+        return reinterpret_cast<const unsigned char*>(p);
+}
+
+// Size of the storage, row padding included.
+size_t size_bytes() const {
+        return size_t(stride_) * height_ * sizeof(Color);
 }
 
 void fade(double f) {
-        for (auto& a : *this) {
-                a = a * f;
-        }
+        kernels::fade(pixels, size_t(stride_) * height_, f);
+}
+
+void fill(const Color& c) {
+        kernels::fill(pixels, size_t(stride_) * height_, c);
+}
+
+// Saturating per-channel sum with an image of the same size.
+void add(const Image& o) {
+        kernels::add(bytes(pixels), bytes(o.pixels), size_bytes());
+}
+
+// Mixes o over this image with weight alpha in [0, 1].
+void blend(const Image& o, double alpha) {
+        kernels::blend(bytes(pixels), bytes(o.pixels), size_bytes(), alpha);
 }
 
     #ifdef GL_POINTS
-void draw_at(int h, int k) {
+void draw_at(int h, int k) const {
         for (int i = 0; i < height_; i++)
                 for (int j = 0; j < width_; j++) {
                         int p, q;
@@ -172,41 +375,21 @@ void draw_at(int h, int k) {
 }
     #endif
 
-~Image() {
-        delete pixels;
+Image matrix_filter(double filter[3][3]) {
+        return convolve(Kernel(3, 3, &filter[0][0]));
 }
 
-Image operator=(Image i) {
-        delete pixels;
-        width_ = i.width_;
-        height_ = i.height_;
-        pixels = new Color[width_ * height_];
-        memcpy(pixels, i.pixels, width_ * height_ * sizeof(Color));
-        return i;
+// Correlates the image with k, treating pixels outside it as black.
+Image convolve(const Kernel& k) const {
+        Image ret(width_, height_);
+        convolve(k, ret);
+        return ret;
 }
 
-Image matrix_filter(double filter[3][3]) {
-        Image ret(*this);
-        for (int i = 0; i < width_; i++) {
-                for (int j = 0; j < height_; j++) {
-                        double sr = 0;
-                        double sg = 0;
-                        double sb = 0;
-                        for (int k = -1; k < 2; k++) {
-                                for (int l = -1; l < 2; l++) {
-                                        int a = j + k, b = i + l;
-                                        if (a >= 0 && b >= 0 && b < width_ && a < height_) {
-                                                Color aux = at(a, b);
-                                                sr += static_cast<double>(aux.r * filter[k + 1][l + 1]);
-                                                sg += static_cast<double>(aux.g * filter[k + 1][l + 1]);
-                                                sb += static_cast<double>(aux.b * filter[k + 1][l + 1]);
-                                        }
-                                }
-                        }
-                        ret.at(j, i) = Color(sr, sg, sb);
-                }
-        }
-        return ret;
+// Same, writing into out, which must be at least as large and must not
+// share pixels with this image.
+void convolve(const Kernel& k, ImageView out) const {
+        convolution::apply(pixels, stride_, out.data(), out.stride(), width_, height_, k);
 }
 
 Image gaussian_filter() {
@@ -242,14 +425,12 @@ Image erode() {
         int dy[] = {0, 0, 1, -1};
         for (int i = 0; i < height_; i++)
                 for (int j = 0; j < width_; j++) {
-                        Color c = at(i, j);
+                        Color c = pixel(i, j);
                         for (int k = 0; k < 4; k++) {
-                                try {
-                                        Color z = at(i + dy[k], j + dx[k]);
-                                        c = min(c, z);
-                                }catch(int e) {}
+                                if (inside(i + dy[k], j + dx[k]))
+                                        c = min(c, pixel(i + dy[k], j + dx[k]));
                         }
-                        ret.at(i, j) = c;
+                        ret.pixel(i, j) = c;
                 }
         return ret;
 }
@@ -260,14 +441,12 @@ Image dilate() {
         int dy[] = {0, 0, 1, -1};
         for (int i = 0; i < height_; i++)
                 for (int j = 0; j < width_; j++) {
-                        Color c = at(i, j);
+                        Color c = pixel(i, j);
                         for (int k = 0; k < 4; k++) {
-                                try {
-                                        Color z = at(i + dy[k], j + dx[k]);
-                                        c = max(c, z);
-                                }catch(int e) {}
+                                if (inside(i + dy[k], j + dx[k]))
+                                        c = max(c, pixel(i + dy[k], j + dx[k]));
                         }
-                        ret.at(i, j) = c;
+                        ret.pixel(i, j) = c;
                 }
         return ret;
 }
@@ -281,131 +460,144 @@ Image laplace() {
         return matrix_filter(filter);
 }
 
-void save_bmp(const char *nombre) {
-        std::ofstream f(nombre);
-        f.put('B'); f.put('M'); // Tipo
-        int tam = 54 + width_ * height_;
-        f.write(reinterpret_cast<char*>(&tam), sizeof(int));
-        int reservado = 0;
-        f.write(reinterpret_cast<char*>(&reservado), sizeof(int));
-        int offset = 0x36;
-        f.write(reinterpret_cast<char*>(&offset), sizeof(int));
-        int tamCabeceras = 40;
-        f.write(reinterpret_cast<char*>(&tamCabeceras), sizeof(int));
-        f.write(reinterpret_cast<char*>(&width_), sizeof(int)); // ancho
-        f.write(reinterpret_cast<char*>(&height_), sizeof(int)); // alto
-        int16_t planos = 1;
-        f.write(reinterpret_cast<char*>(&planos), sizeof(int16_t));
-        int16_t bits = 24;
-        f.write(reinterpret_cast<char*>(&bits), sizeof(int16_t));
-        int compresion = 0;
-        f.write(reinterpret_cast<char*>(&compresion), sizeof(int));
-        f.put(0); f.put(0); f.put(0); f.put(0); // Tamaño Paleta
-        f.put(0); f.put(0); f.put(0); f.put(0); // BitsPorMetroX
-        f.put(0); f.put(0); f.put(0); f.put(0); // BitsPorMetroY
-        f.put(0); f.put(0); f.put(0); f.put(0); // Colores Usados
-        f.put(0); f.put(0); f.put(0); f.put(0); // Colores Importantes
+// 24-bit BMP, row 0 first (BMP rows go bottom-up, like the canvas). Rows
+// are packed to BGR into a buffer of about a megabyte and written in bulk.
+void save_bmp(const char *nombre) const {
+        std::ofstream f(nombre, std::ios::binary);
         int ajuste = (4 - (width_ * 3) % 4) % 4;
-        // std::cout << f.tellp() << std::endl;
-        for (int i = 0; i < height_; i++) {
-                for (int j = 0; j < width_; j++)
-                        f << at(i, j);
-                for (int j = 0; j < ajuste; j++)
-                        f << Color();
+        size_t linea = size_t(width_) * 3 + ajuste;
+        unsigned char cabecera[54] = {'B', 'M'};
+        put_le32(cabecera + 2, 54 + linea * height_); // Tamaño del archivo
+        put_le32(cabecera + 10, 54); // Offset
+        put_le32(cabecera + 14, 40); // Tamaño de la cabecera
+        put_le32(cabecera + 18, width_); // ancho
+        put_le32(cabecera + 22, height_); // alto
+        cabecera[26] = 1; // Planos
+        cabecera[28] = 24; // Bits
+        f.write(reinterpret_cast<char*>(cabecera), sizeof(cabecera));
+        int filas = std::max<size_t>(1, (1 << 20) / std::max<size_t>(linea, 1));
+        std::vector<unsigned char> buffer(linea * filas, 0);
+        for (int i = 0; i < height_; i += filas) {
+                int n = std::min(filas, height_ - i);
+                for (int k = 0; k < n; k++)
+                        kernels::to_bgr(&buffer[k * linea], row(i + k), width_);
+                f.write(reinterpret_cast<char*>(buffer.data()), linea * n);
         }
-        f.close();
 }
 
+// Maps the file and decodes the rows straight from the mapping. Only
+// uncompressed 24-bit files are understood; on error the image is left as
+// it was. Negative heights (top-down files) are flipped into row order.
 void load_bmp(const char *nombre) {
-        delete pixels;
-        std::ifstream f(nombre);
-        if (f.get() != 'B' || f.get() != 'M') {
+        int fd = open(nombre, O_RDONLY);
+        if (fd < 0) {
+                std::cout << "No se pudo abrir " << nombre << std::endl;
+                return;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= 54)
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
                 std::cout << "No es BMP" << std::endl;
+                return;
         }
-        int tam, head_size;
-        f.read(reinterpret_cast<char*>(&tam), sizeof(int));
-        f.get(); f.get(); f.get(); f.get(); // Reservado
-        f.read(reinterpret_cast<char*>(&head_size), sizeof(int));
-        f.get(); f.get(); f.get(); f.get(); // Offset
-        f.read(reinterpret_cast<char*>(&width_), sizeof(int)); // x++;
-        f.read(reinterpret_cast<char*>(&height_), sizeof(int)); // y++;
-        f.get(); f.get(); // Planos
-        int16_t bits;
-        f.read(reinterpret_cast<char*>(&bits), sizeof(int16_t));
-        f.get(); f.get(); f.get(); f.get(); // Compresion
-        f.get(); f.get(); f.get(); f.get(); // Tamaño Paleta
-        f.get(); f.get(); f.get(); f.get(); // BitsPorMetroX
-        f.get(); f.get(); f.get(); f.get(); // BitsPorMetroY
-        f.get(); f.get(); f.get(); f.get(); // Colores Usados
-        f.get(); f.get(); f.get(); f.get(); // Colores Importantes
-        pixels = new Color[width_ * height_];
-        int ajuste = (4 - (width_ * 3) % 4) % 4;
-        f.seekg(head_size, f.beg);
-        for (int i = 0; i < height_; i++) {
-                for (int j = 0; j < width_; j++) {
-                        f >> at(i, j);
+        const unsigned char *data = static_cast<const unsigned char*>(map);
+        size_t size = st.st_size;
+        int offset = get_le32(data + 10);
+        int w = get_le32(data + 18), h = get_le32(data + 22);
+        int bits = data[28] | data[29] << 8;
+        int compresion = get_le32(data + 30);
+        bool invertida = h < 0;
+        // -INT_MIN overflows; that height stays negative and is rejected.
+        if (invertida && h != INT_MIN)
+                h = -h;
+        size_t linea = (size_t(w) * 3 + 3) / 4 * 4;
+        if (data[0] != 'B' || data[1] != 'M' || bits != 24 || compresion != 0 || w < 0 ||
+            h < 0 || offset < 0 || size_t(offset) + linea * h > size) {
+                std::cout << "No es BMP" << std::endl;
+        } else {
+                reset(w, h);
+                madvise(map, size, MADV_SEQUENTIAL);
+                for (int i = 0; i < h; i++) {
+                        const unsigned char *s = data + offset + linea * (invertida ? h - 1 - i : i);
+                        kernels::from_bgr(row(i), s, w);
                 }
-                for (int j = 0; j < ajuste; j++)
-                        f.get();
         }
-        f.close();
+        munmap(map, size);
+}
+
+// Lossless QOI, usually several times smaller than the BMP.
+void save_qoi(const char *nombre) const {
+        std::vector<unsigned char> data = qoi::encode(view());
+        std::ofstream f(nombre, std::ios::binary);
+        f.write(reinterpret_cast<char*>(data.data()), data.size());
+}
+
+void load_qoi(const char *nombre) {
+        std::ifstream f(nombre, std::ios::binary);
+        std::vector<unsigned char> data((std::istreambuf_iterator<char>(f)),
+                                        std::istreambuf_iterator<char>());
+        int w, h;
+        if (!qoi::header(data.data(), data.size(), &w, &h)) {
+                std::cout << "No es QOI" << std::endl;
+                return;
+        }
+        reset(w, h);
+        if (!qoi::decode(data.data(), data.size(), view()))
+                std::cout << "QOI incompleto" << std::endl;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
 }
 
+static int32_t get_le32(const unsigned char *p) {
+        return int32_t(p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24);
+}
+
+// Copies the h x k region at column p, row q. view(p, q, h, k) gives the
+// same region without copying.
 Image region(int p, int q, int h, int k, Image& r) {
-        delete r.pixels;
-        r.height_ = k;
-        r.pixels = new Color[h * k];
-
-        for (int i = 0; i < k; i++)
-                for (int j = 0; j <h; j++)
-                        try {
-                                r.at(i, j) = at(q + i, p + j);
-                        }catch(int e) {}
+        r = Image(h, k);
+        blit(*this, q, p, r, 0, 0, k, h);
         return r;
 }
 
 
 Image* region(int p, int q, int h, int k) {
         Image* r = new Image(h, k);
-
-        for (int i = 0; i < k; i++)
-                for (int j = 0; j <h; j++)
-                        try {
-                                r->at(i, j) = at(q + i, p + j);
-                        } catch(int e) {}
+        blit(*this, q, p, *r, 0, 0, k, h);
         return r;
 }
 
 
 void draw_at(Image* o, int x, int y) {
-        for (int i = 0; i < height_; i++) {
-                for (int j = 0; j < width_; j++) {
-                        try {
-                                o->at(y + i, x + j) = at(i, j);
-                        } catch (int e) {}
-                }
-        }
+        blit(*this, 0, 0, *o, y, x, height_, width_);
 }
 
     #ifdef GL_H
 void gl_read() {
-        delete pixels;
-        width_ = glutGet(GLUT_WINDOW_WIDTH);
-        height_ = glutGet(GLUT_WINDOW_HEIGHT);
-        pixels = new Color[width_ * height_];
-        glReadPixels(0, 0, width_, height_, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        gl_read(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
 }
 
 void gl_read(int x2, int y2) {
-        delete pixels;
-        width_ = x2;
-        height_ = y2;
-        pixels = new Color[width_ * height_];
-        glReadPixels(0, 0, x, y, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        reset(x2, y2);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glPixelStorei(GL_PACK_ROW_LENGTH, stride_);
+        glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_PACK_ROW_LENGTH, 0);
 }
 
 void gl_draw() {
-        glDrawPixels(x, y, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride_);
+        glDrawPixels(width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
     #endif  // GL_H
 };
@@ -0,0 +1,106 @@
+// Copyright Tacho 2021
+
+#ifndef INDEXED_H_
+#define INDEXED_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "clip.h"
+#include "color.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "view.h"
+
+// Framebuffer of palette indices, one byte per pixel, for scenes drawn from
+// a handful of colors. It is a quarter the size of an Image, so clearing
+// and drawing move a quarter of the memory, and changing a palette entry
+// recolors every pixel that uses it without touching them. expand() turns
+// it into colors, once per frame, when it is presented.
+//
+// Rows go bottom-up and x runs along columns, as in the canvas.
+class IndexedImage {
+public:
+static const int COLORS = 16;
+
+private:
+uint8_t *pixels_;
+int width_, height_;
+int stride_;
+Color palette_[COLORS];
+
+static const int ALIGNMENT = 64;
+
+public:
+IndexedImage(int w, int h, uint8_t k = 0) : width_(w), height_(h) {
+        stride_ = (w + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        size_t n = size_t(stride_) * h;
+        pixels_ = n == 0 ? NULL : static_cast<uint8_t*>(std::aligned_alloc(ALIGNMENT, n));
+        if (n != 0 && pixels_ == NULL)
+                throw std::bad_alloc();
+        fill(k);
+}
+
+IndexedImage(const IndexedImage&) = delete;
+IndexedImage& operator=(const IndexedImage&) = delete;
+
+~IndexedImage() {
+        free(pixels_);
+}
+
+int width() const {
+        return width_;
+}
+
+int height() const {
+        return height_;
+}
+
+Rect bounds() const {
+        return Rect{0, 0, width_ - 1, height_ - 1};
+}
+
+uint8_t* row(int i) const {
+        return pixels_ + size_t(i) * stride_;
+}
+
+Color palette(int k) const {
+        return palette_[k & (COLORS - 1)];
+}
+
+void set_palette(int k, const Color& c) {
+        palette_[k & (COLORS - 1)] = c;
+}
+
+void fill(uint8_t k) {
+        memset(pixels_, k, size_t(stride_) * height_);
+}
+
+// Pixel at row i, column j; ignored outside the image.
+void plot(int i, int j, uint8_t k) {
+        if (i >= 0 && i < height_ && j >= 0 && j < width_)
+                row(i)[j] = k;
+}
+
+// Filled rectangle, corners in any order, clipped to the image.
+void rect(int x1, int y1, int x2, int y2, uint8_t k) {
+        Rect r = make_rect(x1, y1, x2, y2).intersect(bounds());
+        if (r.empty())
+                return;
+        for (int y = r.y0; y <= r.y1; y++)
+                memset(row(y) + r.x0, k, r.width());
+}
+
+// Looks every pixel up in the palette and writes the colors into out,
+// which must be at least as large.
+void expand(ImageView out) const {
+        parallel_for(height_, 32, [&](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                        kernels::expand(out.row(i), row(i), width_, palette_);
+        });
+}
+};
+
+#endif  // INDEXED_H_
@@ -0,0 +1,666 @@
+// Copyright Tacho 2021
+
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PAINT_X86 1
+#endif
+
+#include "color.h"
+
+// Hot loops over pixel buffers, convolution rows and particles. Every
+// kernel has a portable scalar version and, on x86, versions for wider
+// instruction sets, all in the one binary; the widest the CPU supports is
+// selected once at startup, or the level named by PARTICLES_ISA (scalar,
+// sse2, ssse3, avx2, avx512) to test a path. All levels give the same
+// results bit for bit. Alpha stays 255 through the pixel kernels: add and
+// blend keep it by themselves, fade puts it back.
+namespace kernels {
+
+enum Level { SCALAR, SSE2, SSSE3, AVX2, AVX512 };
+
+const char *const LEVEL_NAMES[] = {"scalar", "sse2", "ssse3", "avx2", "avx512"};
+
+// Multiplier in 0.16 fixed point for fade factors in [0, 1).
+inline uint16_t fade_factor(double f) {
+        long m = std::lround(f * 65536.0);
+        return static_cast<uint16_t>(m > 65535 ? 65535 : m);
+}
+
+// Blend weight of the source in 0.8 fixed point, 0..256.
+inline int blend_factor(double alpha) {
+        long a = std::lround(alpha * 256.0);
+        return a < 0 ? 0 : (a > 256 ? 256 : static_cast<int>(a));
+}
+
+inline void fade_scalar(Color *p, size_t pixels, uint16_t m) {
+        for (size_t i = 0; i < pixels; i++) {
+                p[i].r = (p[i].r * uint32_t(m)) >> 16;
+                p[i].g = (p[i].g * uint32_t(m)) >> 16;
+                p[i].b = (p[i].b * uint32_t(m)) >> 16;
+        }
+}
+
+inline void fill_scalar(Color *p, size_t pixels, Color c) {
+        for (size_t i = 0; i < pixels; i++)
+                p[i] = c;
+}
+
+inline void add_scalar(unsigned char *dst, const unsigned char *src, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+                int v = dst[i] + src[i];
+                dst[i] = v > 255 ? 255 : v;
+        }
+}
+
+inline void blend_scalar(unsigned char *dst, const unsigned char *src, size_t n, int a) {
+        for (size_t i = 0; i < n; i++)
+                dst[i] = (src[i] * a + dst[i] * (256 - a)) >> 8;
+}
+
+// Packs pixels into three bytes each, as files and pipes want them, in
+// RGB or BGR order, and back.
+inline void to_rgb_scalar(unsigned char *dst, const Color *src, size_t pixels) {
+        for (size_t i = 0; i < pixels; i++) {
+                dst[3 * i] = src[i].r;
+                dst[3 * i + 1] = src[i].g;
+                dst[3 * i + 2] = src[i].b;
+        }
+}
+
+inline void to_bgr_scalar(unsigned char *dst, const Color *src, size_t pixels) {
+        for (size_t i = 0; i < pixels; i++) {
+                dst[3 * i] = src[i].b;
+                dst[3 * i + 1] = src[i].g;
+                dst[3 * i + 2] = src[i].r;
+        }
+}
+
+inline void from_bgr_scalar(Color *dst, const unsigned char *src, size_t pixels) {
+        for (size_t i = 0; i < pixels; i++)
+                dst[i] = Color(src[3 * i + 2], src[3 * i + 1], src[3 * i]);
+}
+
+// Looks every index up in a 16-color palette; only the low four bits of
+// an index are used.
+inline void expand_scalar(Color *dst, const unsigned char *src, size_t pixels, const Color *palette) {
+        for (size_t i = 0; i < pixels; i++)
+                dst[i] = palette[src[i] & 15];
+}
+
+// out[i] += k * in[i]. A multiply and an add, never fused, so that every
+// level rounds the same.
+inline void axpy_scalar(float *out, const float *in, float k, size_t n) {
+        for (size_t i = 0; i < n; i++)
+                out[i] = out[i] + k * in[i];
+}
+
+// One step of bodies falling toward (cx, cy) with unit acceleration:
+// position += speed, then speed -= (position - c) / |position - c|, or
+// speed.x -= 1 at the center. p points at the first body; each is vx, vy,
+// x, y, `stride` doubles apart.
+inline void orbit_scalar(double *p, size_t n, size_t stride, double cx, double cy) {
+        for (size_t i = 0; i < n; i++, p += stride) {
+                p[2] = p[2] + p[0];
+                p[3] = p[3] + p[1];
+                double dx = p[2] - cx, dy = p[3] - cy;
+                double r2 = dx * dx + dy * dy;
+                if (r2 == 0) {
+                        p[0] = p[0] - 1;
+                } else {
+                        double r = std::sqrt(r2);
+                        p[0] = p[0] - dx / r;
+                        p[1] = p[1] - dy / r;
+                }
+        }
+}
+
+// Tone maps density bins: bins holds count, r, g, b sums per pixel, and
+// each channel becomes sum * scale[min(count, top)] >> 16, clamped. Every
+// such product must fit in 32 bits, as Splat's scales make sure.
+inline void tone_scalar(Color *dst, const uint32_t *bins, size_t pixels, const uint32_t *scale, uint32_t top) {
+        for (size_t i = 0; i < pixels; i++, bins += 4) {
+                uint32_t s = scale[std::min(bins[0], top)];
+                dst[i] = Color((bins[1] * s) >> 16, (bins[2] * s) >> 16, (bins[3] * s) >> 16);
+        }
+}
+
+#ifdef PAINT_X86
+
+// Alpha, the high byte of every pixel word, set.
+__attribute__((target("sse2")))
+inline __m128i alpha_sse2() {
+        return _mm_set1_epi32(static_cast<int>(0xff000000u));
+}
+
+__attribute__((target("sse2")))
+inline void fade_sse2(Color *p, size_t pixels, uint16_t m) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i k = _mm_set1_epi16(static_cast<int16_t>(m));
+        const __m128i alpha = alpha_sse2();
+        size_t i = 0;
+        for (; i + 4 <= pixels; i += 4) {
+                __m128i *q = reinterpret_cast<__m128i*>(p + i);
+                __m128i v = _mm_loadu_si128(q);
+                __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(v, zero), k);
+                __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(v, zero), k);
+                _mm_storeu_si128(q, _mm_or_si128(_mm_packus_epi16(lo, hi), alpha));
+        }
+        fade_scalar(p + i, pixels - i, m);
+}
+
+__attribute__((target("sse2")))
+inline void fill_sse2(Color *p, size_t pixels, Color c) {
+        const __m128i v = _mm_set1_epi32(static_cast<int>(c.word()));
+        size_t i = 0;
+        for (; i + 4 <= pixels; i += 4)
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), v);
+        fill_scalar(p + i, pixels - i, c);
+}
+
+__attribute__((target("sse2")))
+inline void add_sse2(unsigned char *dst, const unsigned char *src, size_t n) {
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+                __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i*>(dst + i));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_adds_epu8(a, b));
+        }
+        add_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2")))
+inline void blend_sse2(unsigned char *dst, const unsigned char *src, size_t n, int a) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ka = _mm_set1_epi16(a);
+        const __m128i kb = _mm_set1_epi16(256 - a);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+                __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i*>(dst + i));
+                __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), ka),
+                                           _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), kb));
+                __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), ka),
+                                           _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), kb));
+                lo = _mm_srli_epi16(lo, 8);
+                hi = _mm_srli_epi16(hi, 8);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+        }
+        blend_scalar(dst + i, src + i, n - i, a);
+}
+
+__attribute__((target("sse2")))
+inline void axpy_sse2(float *out, const float *in, float k, size_t n) {
+        const __m128 kv = _mm_set1_ps(k);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(kv, _mm_loadu_ps(in + i))));
+        axpy_scalar(out + i, in + i, k, n - i);
+}
+
+// One body per step, x and y side by side. The sum of squares comes out
+// in both lanes, added in either order, which is exact.
+__attribute__((target("sse2")))
+inline void orbit_sse2(double *p, size_t n, size_t stride, double cx, double cy) {
+        const __m128d c = _mm_setr_pd(cx, cy);
+        const __m128d center = _mm_setr_pd(1, 0);
+        const __m128d zero = _mm_setzero_pd();
+        for (size_t i = 0; i < n; i++, p += stride) {
+                __m128d speed = _mm_loadu_pd(p);
+                __m128d pos = _mm_add_pd(_mm_loadu_pd(p + 2), speed);
+                __m128d d = _mm_sub_pd(pos, c);
+                __m128d sq = _mm_mul_pd(d, d);
+                __m128d r2 = _mm_add_pd(sq, _mm_shuffle_pd(sq, sq, 1));
+                __m128d pull = _mm_div_pd(d, _mm_sqrt_pd(r2));
+                __m128d at_center = _mm_cmpeq_pd(r2, zero);
+                pull = _mm_or_pd(_mm_and_pd(at_center, center), _mm_andnot_pd(at_center, pull));
+                _mm_storeu_pd(p, _mm_sub_pd(speed, pull));
+                _mm_storeu_pd(p + 2, pos);
+        }
+}
+
+// Four pixels per shuffle, which leaves 12 bytes; the store writes 16, and
+// the 4 extra are overwritten by the next step, so the loop stops while a
+// full 16 bytes still fit in dst.
+__attribute__((target("ssse3")))
+inline size_t pack_ssse3(unsigned char *dst, const Color *src, size_t pixels, __m128i order) {
+        size_t i = 0;
+        for (; 3 * i + 16 <= 3 * pixels; i += 4) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * i), _mm_shuffle_epi8(v, order));
+        }
+        return i;
+}
+
+__attribute__((target("ssse3")))
+inline void to_rgb_ssse3(unsigned char *dst, const Color *src, size_t pixels) {
+        const __m128i order = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        size_t i = pack_ssse3(dst, src, pixels, order);
+        to_rgb_scalar(dst + 3 * i, src + i, pixels - i);
+}
+
+__attribute__((target("ssse3")))
+inline void to_bgr_ssse3(unsigned char *dst, const Color *src, size_t pixels) {
+        const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        size_t i = pack_ssse3(dst, src, pixels, order);
+        to_bgr_scalar(dst + 3 * i, src + i, pixels - i);
+}
+
+// Four pixels from the first 12 of 16 loaded bytes; the load stops while
+// 16 bytes are still left in src.
+__attribute__((target("ssse3")))
+inline void from_bgr_ssse3(Color *dst, const unsigned char *src, size_t pixels) {
+        const __m128i order = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+        const __m128i alpha = alpha_sse2();
+        size_t i = 0;
+        for (; 3 * i + 16 <= 3 * pixels; i += 4) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                                 _mm_or_si128(_mm_shuffle_epi8(v, order), alpha));
+        }
+        from_bgr_scalar(dst + i, src + 3 * i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+inline void fade_avx2(Color *p, size_t pixels, uint16_t m) {
+        const __m256i k = _mm256_set1_epi16(static_cast<int16_t>(m));
+        const __m128i alpha = alpha_sse2();
+        size_t i = 0;
+        for (; i + 4 <= pixels; i += 4) {
+                __m128i *q = reinterpret_cast<__m128i*>(p + i);
+                __m256i w = _mm256_mulhi_epu16(_mm256_cvtepu8_epi16(_mm_loadu_si128(q)), k);
+                __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(w),
+                                                  _mm256_extracti128_si256(w, 1));
+                _mm_storeu_si128(q, _mm_or_si128(packed, alpha));
+        }
+        fade_scalar(p + i, pixels - i, m);
+}
+
+__attribute__((target("avx2")))
+inline void fill_avx2(Color *p, size_t pixels, Color c) {
+        const __m256i v = _mm256_set1_epi32(static_cast<int>(c.word()));
+        size_t i = 0;
+        for (; i + 8 <= pixels; i += 8)
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), v);
+        fill_sse2(p + i, pixels - i, c);
+}
+
+__attribute__((target("avx2")))
+inline void add_avx2(unsigned char *dst, const unsigned char *src, size_t n) {
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i*>(dst + i));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_adds_epu8(a, b));
+        }
+        add_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void blend_avx2(unsigned char *dst, const unsigned char *src, size_t n, int a) {
+        const __m256i ka = _mm256_set1_epi16(a);
+        const __m256i kb = _mm256_set1_epi16(256 - a);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+                __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i*>(dst + i)));
+                __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+                __m256i w = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, ka),
+                                                               _mm256_mullo_epi16(d, kb)), 8);
+                __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(w),
+                                                  _mm256_extracti128_si256(w, 1));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+        }
+        blend_scalar(dst + i, src + i, n - i, a);
+}
+
+__attribute__((target("avx2")))
+inline void axpy_avx2(float *out, const float *in, float k, size_t n) {
+        const __m256 kv = _mm256_set1_ps(k);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+                _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i),
+                                                        _mm256_mul_ps(kv, _mm256_loadu_ps(in + i))));
+        axpy_sse2(out + i, in + i, k, n - i);
+}
+
+// Two bodies per step: their vx, vy, x, y are 32 contiguous bytes each,
+// regrouped into one register of speeds and one of positions.
+__attribute__((target("avx2")))
+inline void orbit_avx2(double *p, size_t n, size_t stride, double cx, double cy) {
+        const __m256d c = _mm256_setr_pd(cx, cy, cx, cy);
+        const __m256d center = _mm256_setr_pd(1, 0, 1, 0);
+        const __m256d zero = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2, p += 2 * stride) {
+                __m256d a = _mm256_loadu_pd(p), b = _mm256_loadu_pd(p + stride);
+                __m256d speed = _mm256_permute2f128_pd(a, b, 0x20);
+                __m256d pos = _mm256_add_pd(_mm256_permute2f128_pd(a, b, 0x31), speed);
+                __m256d d = _mm256_sub_pd(pos, c);
+                __m256d sq = _mm256_mul_pd(d, d);
+                __m256d r2 = _mm256_hadd_pd(sq, sq);
+                __m256d pull = _mm256_div_pd(d, _mm256_sqrt_pd(r2));
+                pull = _mm256_blendv_pd(pull, center, _mm256_cmp_pd(r2, zero, _CMP_EQ_OQ));
+                speed = _mm256_sub_pd(speed, pull);
+                _mm256_storeu_pd(p, _mm256_permute2f128_pd(speed, pos, 0x20));
+                _mm256_storeu_pd(p + stride, _mm256_permute2f128_pd(speed, pos, 0x31));
+        }
+        orbit_sse2(p, n - i, stride, cx, cy);
+}
+
+// Eight pixels per step. Their scales are looked up one by one, which
+// beats vpgatherdd where gathers are microcoded, then spread over the four
+// lanes of each bin, two bins to a register. The count lane carries junk
+// that the final shift drops, and two saturating packs clamp the channels.
+__attribute__((target("avx2")))
+inline void tone_avx2(Color *dst, const uint32_t *bins, size_t pixels, const uint32_t *scale, uint32_t top) {
+        const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xff000000u));
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        const int *table = reinterpret_cast<const int*>(scale);
+        size_t i = 0;
+        for (; i + 8 <= pixels; i += 8, bins += 32) {
+                __m256i s = _mm256_setr_epi32(table[std::min(bins[0], top)], table[std::min(bins[4], top)],
+                                              table[std::min(bins[8], top)], table[std::min(bins[12], top)],
+                                              table[std::min(bins[16], top)], table[std::min(bins[20], top)],
+                                              table[std::min(bins[24], top)], table[std::min(bins[28], top)]);
+                __m256i v[4];
+                for (int k = 0; k < 4; k++) {
+                        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bins + 8 * k));
+                        __m256i spread = _mm256_setr_epi32(2 * k, 2 * k, 2 * k, 2 * k,
+                                                           2 * k + 1, 2 * k + 1, 2 * k + 1, 2 * k + 1);
+                        __m256i sk = _mm256_permutevar8x32_epi32(s, spread);
+                        v[k] = _mm256_srli_epi32(_mm256_mullo_epi32(b, sk), 16);
+                }
+                // Pixels 0 2 4 6 | 1 3 5 7, each count, r, g, b.
+                __m256i w = _mm256_packus_epi16(_mm256_packus_epi32(v[0], v[1]), _mm256_packus_epi32(v[2], v[3]));
+                w = _mm256_permutevar8x32_epi32(w, order);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_or_si256(_mm256_srli_epi32(w, 8), alpha));
+        }
+        tone_scalar(dst + i, bins, pixels - i, scale, top);
+}
+
+// Sixteen pixels per step: each channel of the palette fits in one
+// register, so a shuffle by the indices looks up sixteen of it at once,
+// and two rounds of unpacking interleave the four channels into pixels.
+__attribute__((target("ssse3")))
+inline void expand_ssse3(Color *dst, const unsigned char *src, size_t pixels, const Color *palette) {
+        alignas(16) unsigned char channel[4][16];
+        for (int k = 0; k < 16; k++) {
+                channel[0][k] = palette[k].r;
+                channel[1][k] = palette[k].g;
+                channel[2][k] = palette[k].b;
+                channel[3][k] = palette[k].a;
+        }
+        const __m128i r = _mm_load_si128(reinterpret_cast<__m128i*>(channel[0]));
+        const __m128i g = _mm_load_si128(reinterpret_cast<__m128i*>(channel[1]));
+        const __m128i b = _mm_load_si128(reinterpret_cast<__m128i*>(channel[2]));
+        const __m128i a = _mm_load_si128(reinterpret_cast<__m128i*>(channel[3]));
+        const __m128i low = _mm_set1_epi8(15);
+        size_t i = 0;
+        for (; i + 16 <= pixels; i += 16) {
+                __m128i k = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)), low);
+                __m128i vr = _mm_shuffle_epi8(r, k), vg = _mm_shuffle_epi8(g, k);
+                __m128i vb = _mm_shuffle_epi8(b, k), va = _mm_shuffle_epi8(a, k);
+                __m128i rg_lo = _mm_unpacklo_epi8(vr, vg), rg_hi = _mm_unpackhi_epi8(vr, vg);
+                __m128i ba_lo = _mm_unpacklo_epi8(vb, va), ba_hi = _mm_unpackhi_epi8(vb, va);
+                __m128i *q = reinterpret_cast<__m128i*>(dst + i);
+                _mm_storeu_si128(q, _mm_unpacklo_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128(q + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+                _mm_storeu_si128(q + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+                _mm_storeu_si128(q + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+        }
+        expand_scalar(dst + i, src + i, pixels - i, palette);
+}
+
+// AVX-512 with byte and word instructions. Masked loads and stores finish
+// each row, so there is no scalar tail.
+#define PAINT_AVX512 "avx512f,avx512bw"
+
+__attribute__((target(PAINT_AVX512)))
+inline __mmask64 tail_mask(size_t n) {
+        return n >= 64 ? ~__mmask64(0) : (__mmask64(1) << n) - 1;
+}
+
+__attribute__((target(PAINT_AVX512)))
+inline void fade_avx512(Color *p, size_t pixels, uint16_t m) {
+        const __m512i k = _mm512_set1_epi16(static_cast<int16_t>(m));
+        const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xff000000u));
+        size_t i = 0;
+        for (; i + 8 <= pixels; i += 8) {
+                __m256i *q = reinterpret_cast<__m256i*>(p + i);
+                __m512i w = _mm512_mulhi_epu16(_mm512_cvtepu8_epi16(_mm256_loadu_si256(q)), k);
+                _mm256_storeu_si256(q, _mm256_or_si256(_mm512_maskz_cvtepi16_epi8(~__mmask32(0), w), alpha));
+        }
+        fade_scalar(p + i, pixels - i, m);
+}
+
+__attribute__((target(PAINT_AVX512)))
+inline void fill_avx512(Color *p, size_t pixels, Color c) {
+        const __m512i v = _mm512_set1_epi32(static_cast<int>(c.word()));
+        size_t i = 0;
+        for (; i + 16 <= pixels; i += 16)
+                _mm512_storeu_si512(p + i, v);
+        if (i < pixels)
+                _mm512_mask_storeu_epi32(p + i, __mmask16((1u << (pixels - i)) - 1), v);
+}
+
+__attribute__((target(PAINT_AVX512)))
+inline void add_avx512(unsigned char *dst, const unsigned char *src, size_t n) {
+        for (size_t i = 0; i < n; i += 64) {
+                __mmask64 m = tail_mask(n - i);
+                __m512i a = _mm512_maskz_loadu_epi8(m, dst + i);
+                __m512i b = _mm512_maskz_loadu_epi8(m, src + i);
+                _mm512_mask_storeu_epi8(dst + i, m, _mm512_adds_epu8(a, b));
+        }
+}
+
+__attribute__((target(PAINT_AVX512)))
+inline void blend_avx512(unsigned char *dst, const unsigned char *src, size_t n, int a) {
+        const __m512i ka = _mm512_set1_epi16(a);
+        const __m512i kb = _mm512_set1_epi16(256 - a);
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+                __m512i d = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<__m256i*>(dst + i)));
+                __m512i s = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+                __m512i w = _mm512_srli_epi16(_mm512_add_epi16(_mm512_mullo_epi16(s, ka),
+                                                               _mm512_mullo_epi16(d, kb)), 8);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm512_maskz_cvtepi16_epi8(~__mmask32(0), w));
+        }
+        blend_scalar(dst + i, src + i, n - i, a);
+}
+
+// AVX-512 implies FMA, and the compiler would fuse a plain multiply and
+// add; the explicitly rounded forms are left as they are. Here and above,
+// the zero-masking forms keep GCC from warning about the undefined
+// pass-through of the unmasked ones.
+__attribute__((target(PAINT_AVX512)))
+inline void axpy_avx512(float *out, const float *in, float k, size_t n) {
+        const int nearest = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+        const __m512 kv = _mm512_set1_ps(k);
+        for (size_t i = 0; i < n; i += 16) {
+                __mmask16 m = n - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (n - i)) - 1);
+                __m512 p = _mm512_maskz_mul_round_ps(m, kv, _mm512_maskz_loadu_ps(m, in + i), nearest);
+                _mm512_mask_storeu_ps(out + i, m, _mm512_maskz_add_round_ps(m, _mm512_maskz_loadu_ps(m, out + i), p, nearest));
+        }
+}
+
+#endif  // PAINT_X86
+
+// The kernel set picked for this CPU.
+struct Table {
+        Level level;
+        void (*fade)(Color*, size_t, uint16_t);
+        void (*fill)(Color*, size_t, Color);
+        void (*add)(unsigned char*, const unsigned char*, size_t);
+        void (*blend)(unsigned char*, const unsigned char*, size_t, int);
+        void (*to_rgb)(unsigned char*, const Color*, size_t);
+        void (*to_bgr)(unsigned char*, const Color*, size_t);
+        void (*from_bgr)(Color*, const unsigned char*, size_t);
+        void (*expand)(Color*, const unsigned char*, size_t, const Color*);
+        void (*axpy)(float*, const float*, float, size_t);
+        void (*orbit)(double*, size_t, size_t, double, double);
+        void (*tone)(Color*, const uint32_t*, size_t, const uint32_t*, uint32_t);
+};
+
+// The kernels for a level: each level replaces what it does better than
+// the one below and keeps the rest.
+inline Table table_for(Level level) {
+        Table t{SCALAR, fade_scalar, fill_scalar, add_scalar, blend_scalar, to_rgb_scalar,
+                to_bgr_scalar, from_bgr_scalar, expand_scalar, axpy_scalar, orbit_scalar,
+                tone_scalar};
+#ifdef PAINT_X86
+        if (level >= SSE2) {
+                t.level = SSE2;
+                t.fade = fade_sse2;
+                t.fill = fill_sse2;
+                t.add = add_sse2;
+                t.blend = blend_sse2;
+                t.axpy = axpy_sse2;
+                t.orbit = orbit_sse2;
+        }
+        if (level >= SSSE3) {
+                t.level = SSSE3;
+                t.to_rgb = to_rgb_ssse3;
+                t.to_bgr = to_bgr_ssse3;
+                t.from_bgr = from_bgr_ssse3;
+                t.expand = expand_ssse3;
+        }
+        if (level >= AVX2) {
+                t.level = AVX2;
+                t.fade = fade_avx2;
+                t.fill = fill_avx2;
+                t.add = add_avx2;
+                t.blend = blend_avx2;
+                t.axpy = axpy_avx2;
+                t.orbit = orbit_avx2;
+                t.tone = tone_avx2;
+        }
+        if (level >= AVX512) {
+                t.level = AVX512;
+                t.fade = fade_avx512;
+                t.fill = fill_avx512;
+                t.add = add_avx512;
+                t.blend = blend_avx512;
+                t.axpy = axpy_avx512;
+        }
+#endif
+        return t;
+}
+
+// The widest level this CPU and OS support.
+inline Level detect() {
+#ifdef PAINT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+                return AVX512;
+        if (__builtin_cpu_supports("avx2"))
+                return AVX2;
+        if (__builtin_cpu_supports("ssse3"))
+                return SSSE3;
+        return __builtin_cpu_supports("sse2") ? SSE2 : SCALAR;
+#else
+        return SCALAR;
+#endif
+}
+
+inline Table select() {
+        Level level = detect();
+        const char *isa = getenv("PARTICLES_ISA");
+        if (isa != NULL) {
+                int wanted = -1;
+                for (int i = SCALAR; i <= AVX512; i++)
+                        if (std::string(isa) == LEVEL_NAMES[i])
+                                wanted = i;
+                if (wanted < 0)
+                        std::cerr << "Unknown PARTICLES_ISA '" << isa << "', using " << LEVEL_NAMES[level] << std::endl;
+                else if (wanted > level)
+                        std::cerr << "This CPU has no " << isa << ", using " << LEVEL_NAMES[level] << std::endl;
+                else
+                        level = static_cast<Level>(wanted);
+        }
+        return table_for(level);
+}
+
+inline const Table& table() {
+        static const Table t = select();
+        return t;
+}
+
+// Sets `pixels` pixels to c.
+inline void fill(Color *p, size_t pixels, Color c) {
+        table().fill(p, pixels, c);
+}
+
+// Multiplies every channel by f, truncating, like Color::operator*.
+inline void fade(Color *p, size_t pixels, double f) {
+        if (f <= 0) {
+                fill(p, pixels, Color::black);
+        } else if (f < 1) {
+                table().fade(p, pixels, fade_factor(f));
+        } else {
+                for (size_t i = 0; i < pixels; i++)
+                        p[i] = p[i] * f;
+        }
+}
+
+// dst = min(dst + src, 255), byte by byte.
+inline void add(unsigned char *dst, const unsigned char *src, size_t n) {
+        table().add(dst, src, n);
+}
+
+// dst = src * alpha + dst * (1 - alpha), with alpha in 1/256 steps.
+inline void blend(unsigned char *dst, const unsigned char *src, size_t n, double alpha) {
+        table().blend(dst, src, n, blend_factor(alpha));
+}
+
+// Three bytes per pixel, red first, as raw video wants them.
+inline void to_rgb(unsigned char *dst, const Color *src, size_t pixels) {
+        table().to_rgb(dst, src, pixels);
+}
+
+// Three bytes per pixel, blue first, as BMP files store them.
+inline void to_bgr(unsigned char *dst, const Color *src, size_t pixels) {
+        table().to_bgr(dst, src, pixels);
+}
+
+inline void from_bgr(Color *dst, const unsigned char *src, size_t pixels) {
+        table().from_bgr(dst, src, pixels);
+}
+
+// dst[i] = palette[src[i] & 15] for a 16-color palette.
+inline void expand(Color *dst, const unsigned char *src, size_t pixels, const Color *palette) {
+        table().expand(dst, src, pixels, palette);
+}
+
+// out[i] += k * in[i].
+inline void axpy(float *out, const float *in, float k, size_t n) {
+        table().axpy(out, in, k, n);
+}
+
+// Moves n bodies one step toward (cx, cy), see orbit_scalar().
+inline void orbit(double *p, size_t n, size_t stride, double cx, double cy) {
+        table().orbit(p, n, stride, cx, cy);
+}
+
+// Density bins to pixels, see tone_scalar().
+inline void tone(Color *dst, const uint32_t *bins, size_t pixels, const uint32_t *scale, uint32_t top) {
+        table().tone(dst, bins, pixels, scale, top);
+}
+
+inline const char* name() {
+        return LEVEL_NAMES[table().level];
+}
+
+}  // namespace kernels
+
+#endif  // KERNELS_H_
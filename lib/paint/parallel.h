@@ -0,0 +1,138 @@
+// Copyright Tacho 2021
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of worker threads used by parallel_for.
+inline int worker_count() {
+        static const int n = std::max(1u, std::thread::hardware_concurrency());
+        return n;
+}
+
+// Runs in each pool thread before it takes any work, e.g. to give it a
+// signal stack. Set it before the first parallel_for.
+inline void (*worker_init)() = NULL;
+
+// worker_count() - 1 threads started on first use and kept for the life of
+// the process; the thread calling parallel_for is the last worker. One
+// job runs at a time: a parallel_for issued from inside a job, or while
+// another thread's job is running, runs inline on its caller.
+class WorkerPool {
+private:
+std::mutex mutex_;
+std::condition_variable wake_, done_;
+std::vector<std::thread> threads_;
+std::mutex busy_;  // held by the thread whose job is running
+void (*run_)(void*) = NULL;
+void *job_ = NULL;
+int helpers_ = 0;  // pool threads taking part in the current job
+int pending_ = 0;  // of those, the ones not finished yet
+uint64_t generation_ = 0;
+bool stopping_ = false;
+
+static bool& inside_job() {
+        thread_local bool inside = false;
+        return inside;
+}
+
+void work(int index) {
+        if (worker_init != NULL)
+                worker_init();
+        inside_job() = true;
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+                wake_.wait(lock, [&]() { return stopping_ || generation_ != seen; });
+                if (stopping_)
+                        return;
+                seen = generation_;
+                if (index >= helpers_)
+                        continue;
+                lock.unlock();
+                run_(job_);
+                lock.lock();
+                if (--pending_ == 0)
+                        done_.notify_one();
+        }
+}
+
+public:
+WorkerPool() {
+        for (int i = 0; i + 1 < worker_count(); i++)
+                threads_.emplace_back(&WorkerPool::work, this, i);
+}
+
+~WorkerPool() {
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& t : threads_)
+                t.join();
+}
+
+static WorkerPool& get() {
+        static WorkerPool pool;
+        return pool;
+}
+
+// Runs run(job) on the caller and on helpers pool threads, returning once
+// all of them have. False, with nothing run, if the pool is taken.
+bool run(int helpers, void (*run)(void*), void *job) {
+        if (inside_job() || !busy_.try_lock())
+                return false;
+        helpers = std::min<int>(helpers, threads_.size());
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+                run_ = run;
+                job_ = job;
+                helpers_ = pending_ = helpers;
+                generation_++;
+        }
+        wake_.notify_all();
+        inside_job() = true;
+        run(job);
+        inside_job() = false;
+        {
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_.wait(lock, [&]() { return pending_ == 0; });
+        }
+        busy_.unlock();
+        return true;
+}
+};
+
+// Calls body(begin, end) over chunks of [0, n) of at most `grain` items,
+// handing chunks out to up to worker_count() threads of the WorkerPool. The
+// calling thread takes part; small ranges run inline without waking any.
+template<class F>
+void parallel_for(int n, int grain, F body) {
+        if (n <= 0)
+                return;
+        grain = std::max(grain, 1);
+        int chunks = (n + grain - 1) / grain;
+        int workers = std::min(worker_count(), chunks);
+        if (workers <= 1) {
+                body(0, n);
+                return;
+        }
+        std::atomic<int> next(0);
+        auto run = [&]() {
+                for (int c = next++; c < chunks; c = next++)
+                        body(c * grain, std::min(n, (c + 1) * grain));
+        };
+        auto call = [](void *job) { (*static_cast<decltype(run)*>(job))(); };
+        if (!WorkerPool::get().run(workers - 1, call, &run))
+                run();
+}
+
+#endif  // PARALLEL_H_
@@ -0,0 +1,194 @@
+// Copyright Tacho 2021
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "image.h"
+#include "parallel.h"
+
+// Lazy chain of the Image point and stencil operations. Nothing is computed
+// until run(): then every tile of the source goes through all the stages
+// while it is in cache, and only the output image is written.
+//
+//     Image edges = Pipeline(img).gray_scale().derivative().threshold().run();
+//
+// gives the same pixels as img.gray_scale().derivative().threshold().
+class Pipeline {
+private:
+enum Kind {
+        GRAY,
+        THRESHOLD,
+        THRESHOLD_UP,
+        X_DERIVATIVE,
+        Y_DERIVATIVE,
+        DERIVATIVE
+};
+
+struct Stage {
+        Kind kind;
+        unsigned char min;
+        Color down, up;
+};
+
+ConstImageView source_;
+std::vector<Stage> stages_;
+
+Pipeline& push(Kind kind, unsigned char min = 0, Color down = Color(), Color up = Color()) {
+        stages_.push_back(Stage{kind, min, down, up});
+        return *this;
+}
+
+static bool stencil(Kind kind) {
+        return kind == X_DERIVATIVE || kind == Y_DERIVATIVE || kind == DERIVATIVE;
+}
+
+// Rows above and columns to the left each tile needs from its neighbours:
+// every stencil stage looks one pixel up or left.
+int halo() const {
+        int n = 0;
+        for (const Stage& s : stages_)
+                n += stencil(s.kind);
+        return n;
+}
+
+// Runs a point-wise stage over the n pixels of a tile. The tile is in cache
+// by now, so a tight loop per stage beats switching on the kind per pixel.
+static void point(const Stage& s, Color *tile, int n) {
+        switch (s.kind) {
+        case GRAY:
+                for (int k = 0; k < n; k++)
+                        tile[k] = tile[k].to_gray();
+                break;
+        case THRESHOLD:
+                for (int k = 0; k < n; k++)
+                        tile[k] = tile[k].light() > s.min ? tile[k] : s.down;
+                break;
+        case THRESHOLD_UP:
+                for (int k = 0; k < n; k++)
+                        tile[k] = tile[k].light() > s.min ? s.up : s.down;
+                break;
+        default:
+                break;
+        }
+}
+
+// absdif() and max() from color.h, quirks included (their green and blue
+// compare against the red channel), written over plain ints so that the
+// compiler can use conditional moves: on noisy images the branches of the
+// Color versions mispredict about half the time.
+static Color difference(Color a, Color b) {
+        int ar = a.r, ag = a.g, ab = a.b, br = b.r, bg = b.g, bb = b.b;
+        int hr = ar > br ? ar : br, lr = ar < br ? ar : br;
+        int hg = ag > bg ? ar : bg, lg = ag < bg ? ar : bg;
+        int hb = ar > bb ? ab : bb, lb = ar < bb ? ab : bb;
+        Color c;
+        c.r = hr - lr > 0 ? hr - lr : 0;
+        c.g = hg - lg > 0 ? hg - lg : 0;
+        c.b = hb - lb > 0 ? hb - lb : 0;
+        return c;
+}
+
+static Color larger(Color a, Color b) {
+        Color c;
+        c.r = a.r > b.r ? a.r : b.r;
+        c.g = a.g > b.g ? a.r : b.g;
+        c.b = a.r > b.b ? a.b : b.b;
+        return c;
+}
+
+// Applies a stencil stage in place on a rows x cols tile. Walking backwards
+// leaves the up and left neighbours untouched until they have been read.
+// The first row and column follow the image border rule (copy the input);
+// on interior tiles they are halo, and each stage spoils one more halo row
+// and column, which is why the halo is as wide as the number of stages.
+static void apply(Kind kind, Color *tile, int rows, int cols) {
+        for (int r = rows - 1; r >= 0; r--) {
+                Color *p = tile + r * cols;
+                Color *up = r > 0 ? p - cols : NULL;
+                for (int c = cols - 1; c >= 0; c--) {
+                        Color a = p[c];
+                        Color dx = c > 0 ? difference(a, p[c - 1]) : a;
+                        Color dy = up ? difference(a, up[c]) : a;
+                        if (kind == X_DERIVATIVE)
+                                p[c] = dx;
+                        else if (kind == Y_DERIVATIVE)
+                                p[c] = dy;
+                        else
+                                p[c] = larger(dx, dy);
+                }
+        }
+}
+
+public:
+static const int TILE_ROWS = 64;
+static const int TILE_COLS = 256;
+
+explicit Pipeline(ConstImageView source) : source_(source) {}
+
+Pipeline& gray_scale() {
+        return push(GRAY);
+}
+
+Pipeline& x_derivative() {
+        return push(X_DERIVATIVE);
+}
+
+Pipeline& y_derivative() {
+        return push(Y_DERIVATIVE);
+}
+
+Pipeline& derivative() {
+        return push(DERIVATIVE);
+}
+
+Pipeline& threshold(unsigned char min = 128, Color down = Color()) {
+        return push(THRESHOLD, min, down);
+}
+
+Pipeline& threshold(unsigned char min, Color down, Color up) {
+        return push(THRESHOLD_UP, min, down, up);
+}
+
+// Evaluates the chain into out, which must be at least as large as the
+// source and must not share pixels with it.
+void run(ImageView out) const {
+        int w = source_.width(), h = source_.height();
+        int H = halo();
+        int tiles_x = (w + TILE_COLS - 1) / TILE_COLS;
+        int tiles_y = (h + TILE_ROWS - 1) / TILE_ROWS;
+
+        parallel_for(tiles_x * tiles_y, 1, [&](int begin, int end) {
+                std::vector<Color> tile;
+                for (int t = begin; t < end; t++) {
+                        int y0 = t / tiles_x * TILE_ROWS, x0 = t % tiles_x * TILE_COLS;
+                        int hy = std::min(H, y0), hx = std::min(H, x0);
+                        int rows = std::min(TILE_ROWS, h - y0) + hy;
+                        int cols = std::min(TILE_COLS, w - x0) + hx;
+                        tile.resize(size_t(rows) * cols);
+                        for (int r = 0; r < rows; r++)
+                                memcpy(&tile[size_t(r) * cols], source_.row(y0 - hy + r) + x0 - hx,
+                                       cols * sizeof(Color));
+                        for (const Stage& s : stages_) {
+                                if (stencil(s.kind))
+                                        apply(s.kind, tile.data(), rows, cols);
+                                else
+                                        point(s, tile.data(), rows * cols);
+                        }
+                        for (int r = hy; r < rows; r++)
+                                memcpy(out.row(y0 - hy + r) + x0, &tile[size_t(r) * cols + hx],
+                                       (cols - hx) * sizeof(Color));
+                }
+        });
+}
+
+Image run() const {
+        Image out(source_.width(), source_.height());
+        run(out);
+        return out;
+}
+};
+
+#endif  // PIPELINE_H_
@@ -0,0 +1,392 @@
+// Copyright Tacho 2021
+
+#ifndef PRESENTER_H_
+#define PRESENTER_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image.h"
+
+// A presenter takes finished frames off the simulation thread. Backends must
+// return quickly from present(); anything slow happens somewhere else.
+class Presenter {
+public:
+virtual ~Presenter() {}
+
+virtual void present(const Image& frame) = 0;
+};
+
+#ifdef GL_POINTS
+// The on-screen path: draws the frame point by point and swaps buffers.
+class GlutPresenter : public Presenter {
+public:
+void present(const Image& frame) override {
+        frame.draw_at(0, 0);
+        glFlush();
+        glutSwapBuffers();
+}
+};
+#endif
+
+// Writes every frame as <prefix>NNNNNN.bmp (or .qoi) from a background
+// thread. Frames are double buffered: if the writer falls behind, the
+// pending frame is replaced by the newest one and counted as dropped.
+class FilePresenter : public Presenter {
+private:
+std::string prefix_;
+bool qoi_;
+Image buffers_[2];
+int pending_ = -1;
+int writing_ = -1;
+int frame_ = 0;
+int dropped_ = 0;
+bool stop_ = false;
+std::mutex mutex_;
+std::condition_variable ready_;
+std::thread writer_;
+
+void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+                ready_.wait(lock, [this] { return stop_ || pending_ != -1; });
+                if (pending_ == -1)
+                        return;
+                writing_ = pending_;
+                pending_ = -1;
+                int frame = frame_++;
+                lock.unlock();
+
+                char name[32];
+                snprintf(name, sizeof(name), "%06d.%s", frame, qoi_ ? "qoi" : "bmp");
+                if (qoi_)
+                        buffers_[writing_].save_qoi((prefix_ + name).c_str());
+                else
+                        buffers_[writing_].save_bmp((prefix_ + name).c_str());
+
+                lock.lock();
+                writing_ = -1;
+        }
+}
+
+public:
+explicit FilePresenter(const std::string& prefix, bool qoi = false) : prefix_(prefix), qoi_(qoi) {
+        writer_ = std::thread(&FilePresenter::write_loop, this);
+}
+
+~FilePresenter() {
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+        }
+        ready_.notify_one();
+        writer_.join();
+}
+
+void present(const Image& frame) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_ != -1)
+                dropped_++;
+        int slot = writing_ == 0 ? 1 : 0;
+        Image& buffer = buffers_[slot];
+        if (buffer.width() != frame.width() || buffer.height() != frame.height())
+                buffer = frame;
+        else
+                buffer.copy(frame);
+        pending_ = slot;
+        ready_.notify_one();
+}
+
+int dropped() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+}
+};
+
+// Streams frames as one video, either YUV4MPEG2 (4:4:4, BT.601 limited
+// range, which ffmpeg and most players read directly) or headerless rgb24.
+// The target is a file, or a command to pipe into when it starts with '|',
+// for example "|ffmpeg -i - out.mp4". present() copies the frame into a
+// ring of preallocated buffers and a background thread converts and writes
+// them. When the ring is full the frame is dropped, or with BLOCK the
+// simulation waits for the writer, so no frame is lost.
+class VideoPresenter : public Presenter {
+public:
+enum Format { Y4M, RAW };
+enum Policy { DROP, BLOCK };
+
+private:
+Format format_;
+Policy policy_;
+int fps_;
+FILE *out_ = NULL;
+bool pipe_ = false;
+bool failed_ = false;
+std::vector<Image> ring_;
+int head_ = 0, tail_ = 0, count_ = 0;
+int width_ = -1, height_ = -1;
+int dropped_ = 0;
+bool stop_ = false;
+std::mutex mutex_;
+std::condition_variable ready_, space_;
+std::thread writer_;
+std::vector<unsigned char> planes_;
+
+// Rows are written top first, so row 0 (the bottom one) goes last.
+void write_frame(const Image& frame) {
+        int w = frame.width(), h = frame.height();
+        size_t n = size_t(w) * h;
+        planes_.resize(3 * n);
+        if (format_ == RAW) {
+                for (int i = h - 1; i >= 0; i--)
+                        kernels::to_rgb(&planes_[3 * size_t(w) * (h - 1 - i)], frame.row(i), w);
+                failed_ = fwrite(planes_.data(), 1, 3 * n, out_) != 3 * n;
+                return;
+        }
+        unsigned char *y = planes_.data(), *u = y + n, *v = u + n;
+        for (int i = h - 1; i >= 0; i--) {
+                const Color *p = frame.row(i);
+                for (int j = 0; j < w; j++) {
+                        int r = p[j].r, g = p[j].g, b = p[j].b;
+                        *y++ = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+                        *u++ = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                        *v++ = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+                }
+        }
+        failed_ = fputs("FRAME\n", out_) < 0 || fwrite(planes_.data(), 1, 3 * n, out_) != 3 * n;
+}
+
+void write_loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+                ready_.wait(lock, [this] { return stop_ || count_ > 0; });
+                if (count_ == 0)
+                        return;
+                Image& frame = ring_[tail_];
+                lock.unlock();
+
+                if (!failed_) {
+                        write_frame(frame);
+                        if (failed_)
+                                std::cerr << "Video export stopped: write failed" << std::endl;
+                }
+
+                lock.lock();
+                tail_ = (tail_ + 1) % ring_.size();
+                count_--;
+                space_.notify_one();
+        }
+}
+
+public:
+VideoPresenter(const std::string& target, Format format, Policy policy = BLOCK,
+               int slots = 4, int fps = 60)
+        : format_(format), policy_(policy), fps_(fps), ring_(std::max(slots, 1)) {
+        if (!target.empty() && target[0] == '|') {
+                // A reader that goes away must not kill the simulation.
+                signal(SIGPIPE, SIG_IGN);
+                out_ = popen(target.c_str() + 1, "w");
+                pipe_ = true;
+        } else {
+                out_ = fopen(target.c_str(), "wb");
+        }
+        if (out_ == NULL) {
+                perror(target.c_str());
+                failed_ = true;
+        }
+        writer_ = std::thread(&VideoPresenter::write_loop, this);
+}
+
+~VideoPresenter() {
+        {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+        }
+        ready_.notify_one();
+        writer_.join();
+        if (out_ != NULL && pipe_)
+                pclose(out_);
+        else if (out_ != NULL)
+                fclose(out_);
+}
+
+void present(const Image& frame) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (width_ == -1) {
+                // The header goes out before any frame, and fixes the size.
+                width_ = frame.width();
+                height_ = frame.height();
+                if (format_ == Y4M && out_ != NULL)
+                        fprintf(out_, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width_, height_, fps_);
+        }
+        if (frame.width() != width_ || frame.height() != height_) {
+                dropped_++;
+                return;
+        }
+        if (policy_ == BLOCK)
+                space_.wait(lock, [this] { return count_ < int(ring_.size()); });
+        if (count_ == int(ring_.size())) {
+                dropped_++;
+                return;
+        }
+        // Only this thread writes the head slot until it is published.
+        Image& slot = ring_[head_];
+        lock.unlock();
+        if (slot.width() != width_ || slot.height() != height_)
+                slot = Image(width_, height_);
+        slot.copy(frame);
+        lock.lock();
+        head_ = (head_ + 1) % ring_.size();
+        count_++;
+        ready_.notify_one();
+}
+
+int dropped() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+}
+};
+
+// Layout of the shared-memory framebuffer. A viewer maps the object, waits
+// for an even sequence number, copies the pixels and checks that sequence
+// did not change meanwhile; odd means a frame is being written. Pixels are
+// RGBA with alpha 255 (bytes_per_pixel 4; version 1 was packed RGB), row 0
+// is the bottom row (the same orientation as GL).
+struct SharedFrameHeader {
+        char magic[8];
+        uint32_t width;
+        uint32_t height;
+        uint32_t bytes_per_pixel;
+        std::atomic<uint32_t> sequence;
+        uint64_t frame;
+};
+
+// Publishes frames into a POSIX shared memory object (/dev/shm/<name>) that
+// an external viewer process can mmap. Never waits for the reader.
+class SharedMemoryPresenter : public Presenter {
+private:
+std::string name_;
+SharedFrameHeader *header_ = NULL;
+size_t size_ = 0;
+uint64_t frame_ = 0;
+
+void unmap() {
+        if (header_ != NULL)
+                munmap(header_, size_);
+        header_ = NULL;
+}
+
+// Opens a write section (odd sequence) that the first frame written at
+// the new size closes, so a viewer never sees the new dimensions with an
+// even sequence. The sequence only grows, across resizes and runs.
+bool map(int w, int h) {
+        if (header_ != NULL) {
+                header_->sequence.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+        }
+        unmap();
+        size_ = sizeof(SharedFrameHeader) + size_t(w) * h * sizeof(Color);
+        int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+                perror("shm_open");
+                return false;
+        }
+        if (ftruncate(fd, size_) != 0) {
+                perror("ftruncate");
+                close(fd);
+                return false;
+        }
+        void *mem = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+                perror("mmap");
+                return false;
+        }
+        header_ = static_cast<SharedFrameHeader*>(mem);
+        if (memcmp(header_->magic, "PARTSHM2", 8) != 0) {
+                new (mem) SharedFrameHeader();
+                header_->sequence.store(1, std::memory_order_relaxed);
+                memcpy(header_->magic, "PARTSHM2", 8);
+        } else if (header_->sequence.load(std::memory_order_relaxed) % 2 == 0) {
+                // Left by another run.
+                header_->sequence.fetch_add(1, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        header_->width = w;
+        header_->height = h;
+        header_->bytes_per_pixel = sizeof(Color);
+        return true;
+}
+
+public:
+explicit SharedMemoryPresenter(const std::string& name) : name_(name) {
+        if (name_.empty() || name_[0] != '/')
+                name_ = "/" + name_;
+}
+
+~SharedMemoryPresenter() {
+        unmap();
+        shm_unlink(name_.c_str());
+}
+
+void present(const Image& frame) override {
+        if (header_ == NULL || int(header_->width) != frame.width() ||
+            int(header_->height) != frame.height()) {
+                // Leaves the write section open.
+                if (!map(frame.width(), frame.height()))
+                        return;
+        } else {
+                header_->sequence.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+        }
+        Color *pixels = reinterpret_cast<Color*>(header_ + 1);
+        for (int i = 0; i < frame.height(); i++)
+                memcpy(pixels + size_t(i) * frame.width(), frame.row(i), frame.width() * sizeof(Color));
+        header_->frame = frame_++;
+        header_->sequence.fetch_add(1, std::memory_order_release);
+}
+};
+
+// Builds a presenter from a spec such as "glut", "file:frames/f" (BMP),
+// "qoi:frames/f", "y4m:run.y4m", "raw:|ffmpeg ..." or "shm:particles".
+// Video exports wait for the writer unless PARTICLES_EXPORT_POLICY=drop.
+// Returns NULL for unknown specs.
+Presenter* make_presenter(const std::string& spec) {
+        size_t colon = spec.find(':');
+        std::string kind = spec.substr(0, colon);
+        std::string arg = colon == std::string::npos ? "" : spec.substr(colon + 1);
+        #ifdef GL_POINTS
+        if (kind == "glut")
+                return new GlutPresenter();
+        #endif
+        if (kind == "file")
+                return new FilePresenter(arg);
+        if (kind == "qoi")
+                return new FilePresenter(arg, true);
+        if (kind == "y4m" || kind == "raw") {
+                const char *policy = getenv("PARTICLES_EXPORT_POLICY");
+                bool drop = policy != NULL && std::string(policy) == "drop";
+                return new VideoPresenter(arg, kind == "y4m" ? VideoPresenter::Y4M : VideoPresenter::RAW,
+                                          drop ? VideoPresenter::DROP : VideoPresenter::BLOCK);
+        }
+        if (kind == "shm")
+                return new SharedMemoryPresenter(arg.empty() ? "particles" : arg);
+        std::cerr << "Unknown display backend '" << spec << "'" << std::endl;
+        return NULL;
+}
+
+#endif  // PRESENTER_H_
@@ -0,0 +1,217 @@
+// Copyright Tacho 2021
+
+#ifndef QOI_H_
+#define QOI_H_
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "color.h"
+#include "parallel.h"
+#include "view.h"
+
+// The "Quite OK Image" format (qoiformat.org): lossless, byte oriented and
+// simple enough to encode a frame in a few milliseconds. Only the three
+// channel variant is written; alpha is always 255.
+//
+// Files store the top row first, so the last row of a view comes first.
+namespace qoi {
+
+const int HEADER_SIZE = 14;
+const unsigned char PADDING[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+const int STRIP_ROWS = 32;
+
+enum {
+        OP_INDEX = 0x00,
+        OP_DIFF = 0x40,
+        OP_LUMA = 0x80,
+        OP_RUN = 0xc0,
+        OP_RGB = 0xfe,
+        OP_RGBA = 0xff,
+        MASK = 0xc0
+};
+
+inline int hash(Color c) {
+        return (c.r * 3 + c.g * 5 + c.b * 7 + 255 * 11) % 64;
+}
+
+inline void put_be32(unsigned char *p, uint32_t v) {
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+}
+
+inline uint32_t get_be32(const unsigned char *p) {
+        return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Encodes `count` file rows starting at file row `first`, as if `prev` had
+// just been written, and returns the end of the output. The index starts
+// empty: every entry a decoder reads back has been written by this strip,
+// and since alpha is always 255 an empty slot never matches a pixel. That
+// is what lets strips be encoded on their own and simply concatenated.
+inline unsigned char* encode_strip(ConstImageView img, int first, int count, Color prev,
+                                   unsigned char *out) {
+        Color index[64];
+        bool used[64] = {};
+        int run = 0;
+        for (int f = first; f < first + count; f++) {
+                const Color *p = img.row(img.height() - 1 - f);
+                for (int j = 0; j < img.width(); j++) {
+                        Color c = p[j];
+                        if (c == prev) {
+                                if (++run == 62) {
+                                        *out++ = OP_RUN | (run - 1);
+                                        run = 0;
+                                }
+                                continue;
+                        }
+                        if (run > 0) {
+                                *out++ = OP_RUN | (run - 1);
+                                run = 0;
+                        }
+                        int h = hash(c);
+                        if (used[h] && index[h] == c) {
+                                *out++ = OP_INDEX | h;
+                        } else {
+                                index[h] = c;
+                                used[h] = true;
+                                int8_t vr = c.r - prev.r, vg = c.g - prev.g, vb = c.b - prev.b;
+                                int8_t vg_r = vr - vg, vg_b = vb - vg;
+                                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                                        *out++ = OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                                           vg_b > -9 && vg_b < 8) {
+                                        *out++ = OP_LUMA | (vg + 32);
+                                        *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+                                } else {
+                                        *out++ = OP_RGB;
+                                        *out++ = c.r;
+                                        *out++ = c.g;
+                                        *out++ = c.b;
+                                }
+                        }
+                        prev = c;
+                }
+        }
+        if (run > 0)
+                *out++ = OP_RUN | (run - 1);
+        return out;
+}
+
+// Encodes img into a complete QOI file. Strips of STRIP_ROWS rows are
+// encoded in parallel into buffers sized for the worst case, then stitched.
+inline std::vector<unsigned char> encode(ConstImageView img) {
+        int w = img.width(), h = img.height();
+        int strips = (h + STRIP_ROWS - 1) / STRIP_ROWS;
+        size_t worst = size_t(STRIP_ROWS) * w * 4;
+        std::vector<unsigned char> scratch(worst * strips);
+        std::vector<size_t> sizes(strips);
+        parallel_for(strips, 1, [&](int begin, int end) {
+                for (int s = begin; s < end; s++) {
+                        int first = s * STRIP_ROWS;
+                        Color prev;
+                        if (first > 0)
+                                prev = img.row(h - first)[w - 1];
+                        unsigned char *out = &scratch[worst * s];
+                        sizes[s] = encode_strip(img, first, std::min(STRIP_ROWS, h - first), prev, out) - out;
+                }
+        });
+
+        size_t total = HEADER_SIZE + sizeof(PADDING);
+        for (size_t n : sizes)
+                total += n;
+        std::vector<unsigned char> file(total);
+        unsigned char *p = file.data();
+        memcpy(p, "qoif", 4);
+        put_be32(p + 4, w);
+        put_be32(p + 8, h);
+        p[12] = 3;  // channels
+        p[13] = 0;  // sRGB
+        p += HEADER_SIZE;
+        for (int s = 0; s < strips; s++) {
+                memcpy(p, &scratch[worst * s], sizes[s]);
+                p += sizes[s];
+        }
+        memcpy(p, PADDING, sizeof(PADDING));
+        return file;
+}
+
+// Reads the size from a QOI header. Returns false if data is not QOI.
+inline bool header(const unsigned char *data, size_t size, int *w, int *h) {
+        if (size < HEADER_SIZE + sizeof(PADDING) || memcmp(data, "qoif", 4) != 0)
+                return false;
+        uint32_t fw = get_be32(data + 4), fh = get_be32(data + 8);
+        if (fw == 0 || fh == 0 || fw > 1u << 16 || fh > 1u << 16)
+                return false;
+        *w = fw;
+        *h = fh;
+        return true;
+}
+
+// Decodes a QOI file into img, which must have the size given by header().
+// Alpha is dropped. Returns false if the data ends early.
+inline bool decode(const unsigned char *data, size_t size, ImageView img) {
+        Color index[64] = {};
+        unsigned char alpha[64] = {};
+        Color prev;
+        unsigned char a = 255;
+        size_t p = HEADER_SIZE, end = size - sizeof(PADDING);
+        int run = 0;
+        for (int f = 0; f < img.height(); f++) {
+                Color *row = img.row(img.height() - 1 - f);
+                for (int j = 0; j < img.width(); j++) {
+                        if (run > 0) {
+                                run--;
+                        } else {
+                                if (p >= end)
+                                        return false;
+                                int b = data[p++];
+                                if (b == OP_RGB) {
+                                        if (p + 3 > end)
+                                                return false;
+                                        prev.r = data[p];
+                                        prev.g = data[p + 1];
+                                        prev.b = data[p + 2];
+                                        p += 3;
+                                } else if (b == OP_RGBA) {
+                                        if (p + 4 > end)
+                                                return false;
+                                        prev.r = data[p];
+                                        prev.g = data[p + 1];
+                                        prev.b = data[p + 2];
+                                        a = data[p + 3];
+                                        p += 4;
+                                } else if ((b & MASK) == OP_INDEX) {
+                                        prev = index[b];
+                                        a = alpha[b];
+                                } else if ((b & MASK) == OP_DIFF) {
+                                        prev.r += ((b >> 4) & 3) - 2;
+                                        prev.g += ((b >> 2) & 3) - 2;
+                                        prev.b += (b & 3) - 2;
+                                } else if ((b & MASK) == OP_LUMA) {
+                                        if (p >= end)
+                                                return false;
+                                        int b2 = data[p++];
+                                        int vg = (b & 0x3f) - 32;
+                                        prev.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                                        prev.g += vg;
+                                        prev.b += vg - 8 + (b2 & 0x0f);
+                                } else {
+                                        run = b & 0x3f;
+                                }
+                                int h = (prev.r * 3 + prev.g * 5 + prev.b * 7 + a * 11) % 64;
+                                index[h] = prev;
+                                alpha[h] = a;
+                        }
+                        row[j] = prev;
+                }
+        }
+        return true;
+}
+
+}  // namespace qoi
+
+#endif  // QOI_H_
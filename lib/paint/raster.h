@@ -0,0 +1,62 @@
+// Copyright Tacho 2021
+
+#ifndef RASTER_H_
+#define RASTER_H_
+
+#include <cstddef>
+
+#include "clip.h"
+#include "color.h"
+#include "view.h"
+
+// Rasterizers templated on the operation applied to each pixel, so that the
+// operation is inlined into the walk instead of being called through a
+// pointer per pixel. An operation is any callable taking a Color&.
+namespace raster {
+
+// Writes a fixed color.
+struct Set {
+        Color c;
+
+        void operator()(Color& p) const {
+                p = c;
+        }
+};
+
+// Adds a color with saturation, for glowing strokes.
+struct Add {
+        Color c;
+
+        void operator()(Color& p) const {
+                p = p + c;
+        }
+};
+
+// Draws the line (x1, y1)-(x2, y2) into img, x along columns, keeping only
+// the pixels inside clip. The pixels are the ones Canvas::line always drew;
+// the line is clipped once up front and then walked with a pointer that
+// steps one pixel along the major axis and one row or column on the minor.
+template<class Op>
+void line(ImageView img, const Rect& clip, int x1, int y1, int x2, int y2, Op op) {
+        LineSpan l = clip_line(clip.intersect(img.bounds()), x1, y1, x2, y2);
+        if (l.count == 0)
+                return;
+        ptrdiff_t stride = img.stride();
+        Color *p = l.steep ? &img.pixel(l.u, l.v) : &img.pixel(l.v, l.u);
+        ptrdiff_t major = l.steep ? stride : 1;
+        ptrdiff_t minor = l.steep ? l.step : l.step * stride;
+        long long r = l.r;
+        for (int n = 0; n < l.count; n++) {
+                op(*p);
+                p += major;
+                r += l.a;
+                if (r >= l.c) {
+                        r -= l.c;
+                        p += minor;
+                }
+        }
+}
+
+}  // namespace raster
+
+#endif  // RASTER_H_
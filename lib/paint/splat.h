@@ -0,0 +1,156 @@
+// Copyright Tacho 2021
+
+#ifndef SPLAT_H_
+#define SPLAT_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "color.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "view.h"
+
+// Density view for large particle sets. Particles are binned into per-pixel
+// counters (how many landed there and the sum of their colors) instead of
+// being drawn, so each one costs a single 16-byte update and none hides
+// another. resolve() turns the bins into an image: the average color of the
+// pixel, brightened with log(1 + count) so that both sparse and crowded
+// areas stay readable.
+//
+// Every worker bins into its own buffer; resolve() adds them up, which also
+// clears them for the next frame.
+class Splat {
+public:
+struct Point {
+        double x, y;  // x along columns, y along rows
+        Color color;
+};
+
+private:
+struct Bin {
+        uint32_t count, r, g, b;
+};
+
+static_assert(sizeof(Bin) == 4 * sizeof(uint32_t), "kernels::tone reads bins as four words");
+
+int width_, height_;
+std::vector<std::vector<Bin>> buffers_;
+int used_ = 0;                  // buffers written since the last resolve
+uint32_t max_ = 0;              // largest count, when used_ == 1
+std::vector<uint32_t> scale_;   // brightness / count per count, 16.16
+
+static const uint32_t MAX_COUNT = 1 << 16;
+
+std::vector<Bin>& buffer(int k) {
+        if (buffers_[k].empty())
+                buffers_[k].assign(size_t(width_) * height_, Bin{0, 0, 0, 0});
+        return buffers_[k];
+}
+
+// Bins points [begin, end) into buffer k, returning the largest count seen.
+template<class F>
+uint32_t bin(int k, int begin, int end, F point) {
+        Bin *bins = buffer(k).data();
+        uint32_t top = 0;
+        for (int i = begin; i < end; i++) {
+                Point p = point(i);
+                double fx = p.x + 0.5, fy = p.y + 0.5;
+                if (!(fx >= 0 && fx < width_ && fy >= 0 && fy < height_))
+                        continue;
+                int x = static_cast<int>(fx), y = static_cast<int>(fy);
+                Bin& b = bins[size_t(y) * width_ + x];
+                b.count++;
+                b.r += p.color.r;
+                b.g += p.color.g;
+                b.b += p.color.b;
+                top = std::max(top, b.count);
+        }
+        return top;
+}
+
+public:
+Splat(int w, int h) : width_(w), height_(h), buffers_(worker_count()) {}
+
+int width() const {
+        return width_;
+}
+
+int height() const {
+        return height_;
+}
+
+// Bins n points, where point(i) returns the i-th one as a Splat::Point.
+// Points outside the frame are ignored. May be called several times per
+// frame, but not concurrently.
+template<class F>
+void add(int n, F point) {
+        int workers = buffers_.size();
+        int grain = std::max(4096, (n + workers - 1) / workers);
+        int chunks = (n + grain - 1) / grain;
+        std::vector<uint32_t> top(chunks, 0);
+        parallel_for(n, grain, [&](int begin, int end) {
+                int k = begin / grain;
+                top[k] = bin(k, begin, end, point);
+        });
+        if (used_ <= 1 && chunks <= 1 && n > 0)
+                max_ = std::max(max_, top[0]);
+        used_ = std::max(used_, chunks);
+}
+
+// Writes the density image into out, which must have the splat's size, and
+// clears the bins.
+void resolve(ImageView out) {
+        if (used_ == 0)
+                buffer(0);
+        Bin *total = buffers_[0].data();
+        uint32_t top = max_;
+        if (used_ > 1) {
+                std::vector<uint32_t> row_top(height_, 0);
+                parallel_for(height_, 16, [&](int begin, int end) {
+                        for (int y = begin; y < end; y++) {
+                                Bin *t = total + size_t(y) * width_;
+                                for (int k = 1; k < used_; k++) {
+                                        Bin *o = buffers_[k].data() + size_t(y) * width_;
+                                        for (int x = 0; x < width_; x++) {
+                                                t[x].count += o[x].count;
+                                                t[x].r += o[x].r;
+                                                t[x].g += o[x].g;
+                                                t[x].b += o[x].b;
+                                        }
+                                        memset(o, 0, width_ * sizeof(Bin));
+                                }
+                                for (int x = 0; x < width_; x++)
+                                        row_top[y] = std::max(row_top[y], t[x].count);
+                        }
+                });
+                top = *std::max_element(row_top.begin(), row_top.end());
+        }
+        top = std::min(std::max(top, 1u), MAX_COUNT);
+
+        // Brightness 255 * log(1 + c) / log(1 + top), divided by c to turn
+        // the color sums into averages, as one multiplier per count. A
+        // channel sum is at most 255 c, so sum * scale_[c] < 2^24, and past
+        // MAX_COUNT the scale is at most 1: products fit in 32 bits.
+        scale_.resize(top + 1);
+        scale_[0] = 0;
+        double norm = 1 / log1p(double(top));
+        for (uint32_t c = 1; c <= top; c++)
+                scale_[c] = static_cast<uint32_t>(65536.0 * log1p(double(c)) * norm / c);
+
+        parallel_for(height_, 16, [&](int begin, int end) {
+                for (int y = begin; y < end; y++) {
+                        Bin *t = total + size_t(y) * width_;
+                        kernels::tone(out.row(y), reinterpret_cast<const uint32_t*>(t), width_, scale_.data(), top);
+                        memset(t, 0, width_ * sizeof(Bin));
+                }
+        });
+        used_ = 0;
+        max_ = 0;
+}
+};
+
+#endif  // SPLAT_H_
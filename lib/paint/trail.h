@@ -0,0 +1,157 @@
+// Copyright Tacho 2021
+
+#ifndef TRAIL_H_
+#define TRAIL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "image.h"
+
+// Lazily faded trails. Instead of multiplying the whole frame by f every
+// tick, each pixel remembers the frame it was last written and the color it
+// got; its visible value c * f^(now - t) is looked up in a power table when
+// the frame is resolved. Only pixels that are still visible are visited, so a
+// tick costs in proportion to the lit pixels rather than the frame size; a
+// full sweep every sweep_interval frames retires the ones that went black.
+class Trail {
+private:
+int width_, height_;
+uint32_t now_ = 0;
+uint32_t lifetime_;        // age at which every channel has decayed to 0
+int sweep_interval_;
+std::vector<uint32_t> power_;  // f^age in 16.16 fixed point, at most 1
+// Kept together so that resolving a pixel touches a single cache line.
+// The alpha byte of the color, otherwise always 255, holds the flag that
+// says the cell is on the live list, which keeps a cell at eight bytes.
+struct Cell {
+        uint32_t stamp;
+        Color color;
+
+        bool listed() const {
+                return color.a != 0;
+        }
+};
+struct Live {
+        int i, j;
+};
+std::vector<Cell> cells_;
+std::vector<Live> live_;
+
+uint32_t power(uint32_t age) const {
+        return age < power_.size() ? power_[age] : power_.back();
+}
+
+// m is at most 1.0, so no channel can overflow and the clamping
+// constructor is not needed.
+Color decay(Color c, uint32_t age) const {
+        uint32_t m = power(age);
+        c.r = (c.r * m) >> 16;
+        c.g = (c.g * m) >> 16;
+        c.b = (c.b * m) >> 16;
+        c.a = 255;
+        return c;
+}
+
+static Color unlisted() {
+        Color c;
+        c.a = 0;
+        return c;
+}
+
+public:
+Trail(int w, int h, double f, int sweep_interval = 128)
+        : width_(w), height_(h), sweep_interval_(sweep_interval),
+          cells_(w * h, Cell{0, unlisted()}) {
+        lifetime_ = UINT32_MAX;
+        double p = 1;
+        for (uint32_t age = 0; age < 65536; age++) {
+                power_.push_back(static_cast<uint32_t>(std::min(65536.0, floor(p * 65536))));
+                if ((255u * power_.back()) >> 16 == 0) {
+                        lifetime_ = age;
+                        break;
+                }
+                p *= f;
+        }
+}
+
+int width() const {
+        return width_;
+}
+
+int height() const {
+        return height_;
+}
+
+uint32_t now() const {
+        return now_;
+}
+
+// Number of pixels that still have to be resolved every frame.
+size_t live() const {
+        return live_.size();
+}
+
+// Unchecked write of pixel (i, j) at the current frame.
+void plot(int i, int j, Color c) {
+        Cell& cell = cells_[i * width_ + j];
+        cell.stamp = now_;
+        if (!cell.listed())
+                live_.push_back(Live{i, j});
+        cell.color = c;
+        cell.color.a = 255;
+}
+
+void advance() {
+        now_++;
+}
+
+// Current value of pixel (i, j).
+Color at(int i, int j) const {
+        const Cell& cell = cells_[i * width_ + j];
+        if (!cell.listed() || now_ - cell.stamp >= lifetime_)
+                return Color();
+        return decay(cell.color, now_ - cell.stamp);
+}
+
+// Writes the current value of every live pixel into out, which must be the
+// same size and black wherever nothing was plotted.
+void resolve(Image& out) {
+        if (sweep_interval_ <= 1 || now_ % sweep_interval_ == 0) {
+                sweep(out);
+                return;
+        }
+        for (Live l : live_) {
+                const Cell& cell = cells_[l.i * width_ + l.j];
+                uint32_t age = now_ - cell.stamp;
+                out.row(l.i)[l.j] = age < lifetime_ ? decay(cell.color, age) : Color();
+        }
+}
+
+// Resolves by walking the whole frame once, dropping pixels that have
+// faded to black and rebuilding the live list in memory order so the next
+// frames stream through it instead of jumping around.
+void sweep(Image& out) {
+        live_.clear();
+        for (int i = 0; i < height_; i++) {
+                Cell *cell = &cells_[i * width_];
+                Color *p = out.row(i);
+                for (int j = 0; j < width_; j++) {
+                        if (!cell[j].listed())
+                                continue;
+                        uint32_t age = now_ - cell[j].stamp;
+                        if (age < lifetime_) {
+                                p[j] = decay(cell[j].color, age);
+                                live_.push_back(Live{i, j});
+                        } else {
+                                p[j] = Color();
+                                cell[j].color = unlisted();
+                        }
+                }
+        }
+}
+};
+
+#endif  // TRAIL_H_
@@ -0,0 +1,109 @@
+// Copyright Tacho 2021
+
+#ifndef VIEW_H_
+#define VIEW_H_
+
+#include <algorithm>
+#include <cstring>
+
+#include "clip.h"
+#include "color.h"
+#include "kernels.h"
+
+// Non-owning window into pixel rows: a pointer to the first pixel, the
+// distance between rows in pixels and a size. Sub-views share the pixels,
+// so a region of an Image can be read or written in place without copying.
+// T is Color for a writable view and const Color for a read-only one.
+template<class T>
+class View {
+private:
+T *data_;
+int stride_;
+int width_, height_;
+
+public:
+View() : data_(NULL), stride_(0), width_(0), height_(0) {}
+
+View(T *data, int stride, int w, int h)
+        : data_(data), stride_(stride), width_(w), height_(h) {}
+
+// A writable view also works where a read-only one is expected.
+template<class U>
+View(const View<U>& o)
+        : data_(o.data()), stride_(o.stride()), width_(o.width()), height_(o.height()) {}
+
+T* data() const {
+        return data_;
+}
+
+int stride() const {
+        return stride_;
+}
+
+int width() const {
+        return width_;
+}
+
+int height() const {
+        return height_;
+}
+
+bool empty() const {
+        return width_ <= 0 || height_ <= 0;
+}
+
+bool inside(int i, int j) const {
+        return i >= 0 && i < height_ && j >= 0 && j < width_;
+}
+
+Rect bounds() const {
+        return Rect{0, 0, width_ - 1, height_ - 1};
+}
+
+T* row(int i) const {
+        return data_ + size_t(i) * stride_;
+}
+
+T& pixel(int i, int j) const {
+        return row(i)[j];
+}
+
+// The part of r that lies inside this view, as a view of its own.
+View sub(Rect r) const {
+        r = r.intersect(bounds());
+        if (r.empty())
+                return View(data_, stride_, 0, 0);
+        return View(row(r.y0) + r.x0, stride_, r.width(), r.height());
+}
+
+void fill(Color c) const {
+        for (int i = 0; i < height_; i++)
+                kernels::fill(row(i), width_, c);
+}
+};
+
+typedef View<Color> ImageView;
+typedef View<const Color> ConstImageView;
+
+// Copies src into dst at (di, dj), clipped against dst. The two may overlap,
+// as when a region is moved within one image.
+inline void blit(ConstImageView src, ImageView dst, int di = 0, int dj = 0) {
+        int si = 0, sj = 0;
+        int skip = std::max(0, -di);
+        si += skip; di += skip;
+        skip = std::max(0, -dj);
+        sj += skip; dj += skip;
+        int rows = std::min(src.height() - si, dst.height() - di);
+        int cols = std::min(src.width() - sj, dst.width() - dj);
+        if (rows <= 0 || cols <= 0)
+                return;
+        if (dst.row(di) + dj > src.row(si) + sj) {
+                for (int i = rows - 1; i >= 0; i--)
+                        memmove(dst.row(di + i) + dj, src.row(si + i) + sj, cols * sizeof(Color));
+        } else {
+                for (int i = 0; i < rows; i++)
+                        memmove(dst.row(di + i) + dj, src.row(si + i) + sj, cols * sizeof(Color));
+        }
+}
+
+#endif  // VIEW_H_
@@ -0,0 +1,211 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <execinfo.h>
+
+#include "stacktrace.hpp"
+
+// Sampling profiler. A SIGPROF timer interrupts whichever thread is using
+// CPU every 1/hz seconds of CPU time; the handler records the raw stack
+// with backtrace() into a lock-free ring and returns. A background thread
+// drains the rings into counts per distinct stack, and at exit the
+// addresses are symbolized once each and written as folded stacks
+// ("main;Galaxy::draw();Canvas::line(...) 42"), the input of
+// flamegraph.pl and speedscope.
+//
+// A signal handler cannot register a new thread, so rings are not owned:
+// a thread uses the ring picked by its id. Producers claim a cell with a
+// compare-and-swap, which only ever retries when two threads that share a
+// ring are sampled at the same moment. A full ring drops the sample.
+namespace profiler {
+
+const int RINGS = 32;
+const int CELLS = 128;      // per ring, a power of two
+const int MAX_DEPTH = 48;
+// The handler and the signal trampoline it returns through.
+const int SKIP = 2;
+
+struct Cell {
+        std::atomic<uint64_t> sequence;
+        int depth;
+        void *frames[MAX_DEPTH];
+};
+
+// Bounded queue after Dmitry Vyukov's: a cell is free for the producer at
+// position p when its sequence is p, and full for the consumer when it is
+// p + 1.
+struct Ring {
+        std::atomic<uint64_t> head;
+        uint64_t tail;  // consumer only
+        Cell cells[CELLS];
+};
+
+struct State {
+        Ring rings[RINGS];
+        std::atomic<uint64_t> samples, dropped;
+        std::atomic<bool> running;
+        std::thread drainer;
+        std::unordered_map<std::string, uint64_t> stacks;  // raw frames -> count
+        std::string output;
+        int hz;
+};
+
+inline State *state = NULL;
+
+inline void on_sample(int, siginfo_t *, void *) {
+        int saved_errno = errno;
+        State *s = state;
+        if (s != NULL && s->running.load(std::memory_order_relaxed)) {
+                Ring& ring = s->rings[static_cast<unsigned>(syscall(SYS_gettid)) % RINGS];
+                uint64_t pos = ring.head.load(std::memory_order_relaxed);
+                Cell *cell = NULL;
+                while (true) {
+                        Cell& c = ring.cells[pos & (CELLS - 1)];
+                        int64_t dif = int64_t(c.sequence.load(std::memory_order_acquire) - pos);
+                        if (dif == 0) {
+                                if (ring.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                                        cell = &c;
+                                        break;
+                                }
+                        } else if (dif < 0) {
+                                break;
+                        } else {
+                                pos = ring.head.load(std::memory_order_relaxed);
+                        }
+                }
+                if (cell == NULL) {
+                        s->dropped.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                        void *frames[MAX_DEPTH + SKIP];
+                        int n = backtrace(frames, MAX_DEPTH + SKIP) - SKIP;
+                        cell->depth = n > 0 ? n : 0;
+                        if (n > 0)
+                                memcpy(cell->frames, frames + SKIP, n * sizeof(void*));
+                        cell->sequence.store(pos + 1, std::memory_order_release);
+                        s->samples.fetch_add(1, std::memory_order_relaxed);
+                }
+        }
+        errno = saved_errno;
+}
+
+// Moves every finished sample into the stack counts.
+inline void drain(State *s) {
+        for (Ring& ring : s->rings) {
+                while (true) {
+                        Cell& c = ring.cells[ring.tail & (CELLS - 1)];
+                        if (c.sequence.load(std::memory_order_acquire) != ring.tail + 1)
+                                break;
+                        std::string key(reinterpret_cast<const char*>(c.frames), c.depth * sizeof(void*));
+                        s->stacks[key]++;
+                        c.sequence.store(ring.tail + CELLS, std::memory_order_release);
+                        ring.tail++;
+                }
+        }
+}
+
+inline void set_timer(int hz) {
+        struct itimerval timer;
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = hz > 0 ? 1000000 / hz : 0;
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Stops sampling and writes the folded stacks. Runs at exit.
+inline void stop() {
+        State *s = state;
+        if (s == NULL || !s->running.exchange(false))
+                return;
+        set_timer(0);
+        s->drainer.join();
+        drain(s);
+
+        std::unordered_map<void*, std::string> names;
+        std::ofstream out(s->output);
+        for (const auto& stack : s->stacks) {
+                const void *const *frames = reinterpret_cast<const void *const *>(stack.first.data());
+                int depth = stack.first.size() / sizeof(void*);
+                std::string line;
+                // Outermost caller first.
+                for (int i = depth - 1; i >= 0; i--) {
+                        void *addr = const_cast<void*>(frames[i]);
+                        auto it = names.find(addr);
+                        if (it == names.end())
+                                it = names.emplace(addr, Teuchos::symbol_name(addr)).first;
+                        if (!line.empty())
+                                line += ';';
+                        line += it->second;
+                }
+                out << line << ' ' << stack.second << '\n';
+        }
+        std::cerr << "profile: " << s->samples.load() << " samples at " << s->hz << " Hz, "
+                  << s->dropped.load() << " dropped, " << s->stacks.size() << " stacks -> "
+                  << s->output << std::endl;
+}
+
+// Starts sampling at hz samples per CPU second; stop() runs at exit.
+inline bool start(const std::string& output, int hz = 499) {
+        if (state != NULL || hz <= 0 || hz > 100000)
+                return false;
+        // The first backtrace() loads libgcc_s, which must not happen in
+        // the handler.
+        void *warm[1];
+        backtrace(warm, 1);
+        State *s = new State();
+        for (Ring& ring : s->rings) {
+                ring.head = 0;
+                ring.tail = 0;
+                for (int i = 0; i < CELLS; i++)
+                        ring.cells[i].sequence = i;
+        }
+        s->output = output;
+        s->hz = hz;
+        s->running = true;
+        state = s;
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = on_sample;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, NULL);
+
+        s->drainer = std::thread([s]() {
+                while (s->running) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                        drain(s);
+                }
+        });
+        set_timer(hz);
+        atexit(stop);
+        return true;
+}
+
+// Starts from a PARTICLES_PROFILE value, "file" or "file:hz".
+inline bool start_from_spec(const std::string& spec) {
+        size_t colon = spec.rfind(':');
+        if (colon == std::string::npos)
+                return start(spec);
+        return start(spec.substr(0, colon), atoi(spec.c_str() + colon + 1));
+}
+
+}  // namespace profiler
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef SCENARIO_HPP
+#define SCENARIO_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "paint/parallel.h"
+#include "particle.hpp"
+
+// Initial conditions for particle simulations: scenario files, and
+// generators for the usual distributions.
+//
+// A scenario file is a 24-byte header followed by the particles exactly as
+// they are laid out in memory, so loading is a map and a parallel copy:
+//
+//     "PARTSCN1"  magic
+//     uint64      count
+//     uint32      record size, sizeof(Particle) = 40
+//     uint32      flags, 0
+//     count x { double speed.x, speed.y, position.x, position.y;
+//               uint8 r, g, b, a; uint32 0 }
+//
+// All little endian, as written by this machine.
+namespace scenario {
+
+struct Header {
+        char magic[8];
+        uint64_t count;
+        uint32_t record_size;
+        uint32_t flags;
+};
+
+static_assert(sizeof(Header) == 24, "the header is part of the file format");
+static_assert(sizeof(Particle) == 40 && offsetof(Particle, speed) == 0 &&
+              offsetof(Particle, position) == 16 && offsetof(Particle, color) == 32,
+              "records are copied straight into Particle");
+
+const char MAGIC[8] = {'P', 'A', 'R', 'T', 'S', 'C', 'N', '1'};
+
+// Particles per chunk for the copies and generators. Chunks, not threads,
+// own a random stream, so a seed gives the same particles on any machine.
+const int GRAIN = 1 << 16;
+
+// Replaces the contents of pool with the particles in the file. On error
+// the pool is left as it was.
+inline bool load(const std::string& path, ParticlePool& pool) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+                std::cerr << "Cannot open scenario " << path << std::endl;
+                return false;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header))
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                std::cerr << "Not a scenario: " << path << std::endl;
+                return false;
+        }
+        size_t size = st.st_size;
+        Header header;
+        memcpy(&header, map, sizeof(header));
+        const char *records = static_cast<const char*>(map) + sizeof(Header);
+        bool ok = memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                  header.record_size == sizeof(Particle) &&
+                  header.count <= (size - sizeof(Header)) / sizeof(Particle);
+        if (!ok) {
+                std::cerr << "Not a scenario: " << path << std::endl;
+        } else {
+                madvise(map, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+                pool.resize(header.count);
+                Particle *out = pool.data();
+                parallel_for((header.count + GRAIN - 1) / GRAIN, 1, [&](int begin, int end) {
+                        size_t first = size_t(begin) * GRAIN;
+                        size_t last = std::min<size_t>(header.count, size_t(end) * GRAIN);
+                        memcpy(static_cast<void*>(out + first), records + first * sizeof(Particle),
+                               (last - first) * sizeof(Particle));
+                });
+        }
+        munmap(map, size);
+        return ok;
+}
+
+inline bool save(const std::string& path, const ParticlePool& pool) {
+        FILE *f = fopen(path.c_str(), "wb");
+        if (f == NULL) {
+                std::cerr << "Cannot write scenario " << path << std::endl;
+                return false;
+        }
+        Header header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.count = pool.size();
+        header.record_size = sizeof(Particle);
+        header.flags = 0;
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        // Through a buffer, to zero the padding after the color.
+        std::vector<char> buffer(GRAIN * sizeof(Particle));
+        for (size_t first = 0; ok && first < pool.size(); first += GRAIN) {
+                size_t n = std::min<size_t>(GRAIN, pool.size() - first);
+                memcpy(buffer.data(), static_cast<const void*>(&pool[first]), n * sizeof(Particle));
+                for (size_t i = 0; i < n; i++)
+                        memset(&buffer[i * sizeof(Particle) + offsetof(Particle, color) + sizeof(Color)], 0,
+                               sizeof(Particle) - offsetof(Particle, color) - sizeof(Color));
+                ok = fwrite(buffer.data(), sizeof(Particle), n, f) == n;
+        }
+        ok = fclose(f) == 0 && ok;
+        if (!ok)
+                std::cerr << "Cannot write scenario " << path << std::endl;
+        return ok;
+}
+
+// splitmix64, one stream per chunk.
+class Random {
+private:
+uint64_t state_;
+
+public:
+// Each step adds the same constant to the state, so states that differ
+// by a multiple of it give one sequence shifted. Mixing seed and stream
+// puts the streams of a seed at unrelated points of the sequence.
+Random(uint64_t seed, uint64_t stream) : state_(mix(mix(seed) + stream)) {
+}
+
+static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+}
+
+uint64_t next() {
+        return mix(state_ += 0x9E3779B97F4A7C15ull);
+}
+
+// In [0, 1).
+double uniform() {
+        return (next() >> 11) * 0x1.0p-53;
+}
+
+// Uniform over the unit disc. Rejection from the square is cheaper than
+// a square root and a sine and cosine.
+Vector in_disc() {
+        while (true) {
+                double x = 2 * uniform() - 1, y = 2 * uniform() - 1;
+                if (x * x + y * y <= 1)
+                        return Vector(x, y);
+        }
+}
+
+// Uniform direction.
+Vector direction() {
+        while (true) {
+                Vector p = in_disc();
+                double d = p.x * p.x + p.y * p.y;
+                if (d > 1e-12)
+                        return p * (1 / std::sqrt(d));
+        }
+}
+};
+
+// Fills pool with n particles, make(random, i) building each one, a chunk
+// of them per task.
+template<class F>
+void generate(ParticlePool& pool, size_t n, uint64_t seed, F make) {
+        pool.resize(n);
+        Particle *out = pool.data();
+        parallel_for((n + GRAIN - 1) / GRAIN, 1, [&](int begin, int end) {
+                for (int c = begin; c < end; c++) {
+                        Random random(seed, c);
+                        size_t last = std::min<size_t>(n, size_t(c + 1) * GRAIN);
+                        for (size_t i = size_t(c) * GRAIN; i < last; i++)
+                                new (out + i) Particle(make(random, i));
+                }
+        });
+}
+
+// One particle of each distribution below; emitters draw from them too.
+
+// Position uniform over the disc, velocity uniform over the disc of
+// radius max_speed, random color.
+inline Particle disc_particle(Random& random, const Vector& center, double radius, double max_speed) {
+        Vector speed = random.in_disc() * max_speed;
+        Vector position = center + random.in_disc() * radius;
+        return Particle(speed, position, hsl(int(360 * random.uniform())));
+}
+
+// A Plummer sphere of scale radius a seen from above, cut at radius.
+// Positions invert the cumulative mass, speeds come from the distribution
+// function by rejection (Aarseth, Henon and Wielen 1974) in units where
+// the escape speed at the center is max_speed. Colored by distance.
+inline Particle plummer_particle(Random& random, const Vector& center, double a, double radius,
+                                 double max_speed) {
+        double r;
+        do {
+                double m = random.uniform();
+                // m^(-2/3) - 1
+                double k = 1 / std::cbrt(m * m) - 1;
+                r = k > 0 ? a / std::sqrt(k) : radius + 1;
+        } while (r > radius);
+        // Uniform direction in 3D, keeping x and y.
+        double z = 2 * random.uniform() - 1;
+        Vector position = center + random.direction() * (r * std::sqrt(1 - z * z));
+        double q, g, e;
+        do {
+                q = random.uniform();
+                g = 0.1 * random.uniform();
+                e = 1 - q * q;
+        } while (g > q * q * e * e * e * std::sqrt(e));
+        double v = q * max_speed / std::sqrt(std::sqrt(1 + square(r / a)));
+        double vz = 2 * random.uniform() - 1;
+        Vector speed = random.direction() * (v * std::sqrt(1 - vz * vz));
+        return Particle(speed, position, hsl(int(300 * r / radius)));
+}
+
+// A circular orbit around center, counterclockwise, at a radius between
+// r0 and r1 uniform over the annulus. pull(r) is the acceleration toward
+// the center at distance r: gm / r^2 gives Kepler orbits; the galaxy
+// pulls with a constant 1. Colored by radius.
+template<class F>
+Particle orbit_particle(Random& random, const Vector& center, double r0, double r1, F pull) {
+        double r = std::sqrt(square(r0) + random.uniform() * (square(r1) - square(r0)));
+        Vector d = random.direction();
+        double v = std::sqrt(r * pull(r));
+        return Particle(Vector(-d.y, d.x) * v, center + d * r, hsl(int(300 * (r - r0) / (r1 - r0))));
+}
+
+inline void uniform_disc(ParticlePool& pool, size_t n, const Vector& center, double radius,
+                         double max_speed, uint64_t seed) {
+        generate(pool, n, seed, [&](Random& random, size_t) {
+                return disc_particle(random, center, radius, max_speed);
+        });
+}
+
+inline void plummer(ParticlePool& pool, size_t n, const Vector& center, double a, double radius,
+                    double max_speed, uint64_t seed) {
+        generate(pool, n, seed, [&](Random& random, size_t) {
+                return plummer_particle(random, center, a, radius, max_speed);
+        });
+}
+
+// A disc of circular orbits, see orbit_particle().
+template<class F>
+void keplerian(ParticlePool& pool, size_t n, const Vector& center, double r0, double r1,
+               F pull, uint64_t seed) {
+        generate(pool, n, seed, [&](Random& random, size_t) {
+                return orbit_particle(random, center, r0, r1, pull);
+        });
+}
+
+}  // namespace scenario
+
+#endif
@@ -69,6 +69,9 @@ std::string get_stored_stacktrace();
  * stacktrace printout to avoid showing users implementation functions in the
  * stacktrace.
  *
+ * Modules, source files and formatted frames are cached, so repeated
+ * traces through the same code are cheap. Thread safe.
+ *
  * \ingroup TeuchosStackTrace_grp
  */
 std::string get_stacktrace(int impl_stacktrace_depth=0);
@@ -79,12 +82,45 @@ std::string get_stacktrace(int impl_stacktrace_depth=0);
  */
 void show_stacktrace();
 
-/** \brief Prints the current stacktrace to stdout on segfault.
+/** \brief Writes a crash report to stderr on SIGSEGV, SIGBUS, SIGFPE,
+ * SIGILL and SIGABRT, then lets the signal kill the process as usual.
+ *
+ * The handler only calls async-signal-safe functions: it records the raw
+ * return addresses and the module map taken beforehand and writes them
+ * with write(2). Nothing is symbolized at crash time; pass the report to
+ * symbolize_crash_report() for file names and lines.
+ *
+ * It runs on a stack of its own, so a stack overflow is reported too, on
+ * the calling thread and on the parallel_for workers. Call this before
+ * the first parallel_for; other threads get no report for an overflow.
  *
  * \ingroup TeuchosStackTrace_grp
  */
 void print_stack_on_segfault();
 
+/** \brief Takes a new snapshot of the loaded modules for the crash handler.
+ *
+ * Call after loading shared libraries (dlopen(), GL drivers) so that their
+ * addresses can be symbolized.
+ *
+ * \ingroup TeuchosStackTrace_grp
+ */
+void refresh_module_map();
+
+/** \brief Turns a report written by the crash handler into a traceback
+ * like get_stacktrace() prints. Text around the report is ignored.
+ *
+ * \ingroup TeuchosStackTrace_grp
+ */
+std::string symbolize_crash_report(const std::string &report);
+
+/** \brief Returns the demangled name of the function that contains
+ * 'address' in this process, or "module+0xoffset" if it has no symbol.
+ *
+ * \ingroup TeuchosStackTrace_grp
+ */
+std::string symbol_name(const void *address);
+
 } // end namespace Teuchos
 
 #endif // HAVE_TEUCHOS_STACKTRACE
@@ -122,6 +158,10 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
 
+// The implementation lives in this header too; compile it only once.
+#ifndef TEUCHOS_STACKTRACE_IMPL
+#define TEUCHOS_STACKTRACE_IMPL
+
 #ifdef HAVE_TEUCHOS_STACKTRACE
 
 
@@ -140,6 +180,27 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // For registering SIGSEGV callbacks
 #include <csignal>
 
+// For the crash handler: write(2), readlink(2) and the raw formatting
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+// For the symbolization caches
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// For giving the worker threads a signal stack
+#include "paint/parallel.h"
+
 
 // The following C headers are needed for some specific C functionality (see
 // the comments), which is not available in C++:
@@ -216,25 +277,81 @@ std::string remove_leading_whitespace(const std::string &str)
 }
 
 
+/* Symbolization keeps everything it opens for the life of the process:
+   the bfd handles and symbol tables of the modules, the source files and
+   the formatted frames. A trace of frames seen before then costs a
+   dl_iterate_phdr() and a hash lookup per frame. All of it is guarded by
+   symbolize_mutex, which the callers of find_line(), addr2str() and
+   read_line_from_file() hold.
+*/
+std::mutex symbolize_mutex;
+
+
+/* A source file mapped into memory, with the offset of each line. */
+struct source_file {
+    const char *text;
+    size_t size;
+    std::vector<size_t> line_starts;
+};
+
+std::map<std::string, source_file> source_files;
+
+
+/* Maps 'filename' and indexes its lines, or returns NULL if it cannot be
+   read. Failures are remembered too.
+*/
+const source_file *open_source_file(const std::string &filename)
+{
+    std::map<std::string, source_file>::iterator it = source_files.find(filename);
+    if (it != source_files.end())
+        return it->second.text != NULL ? &it->second : NULL;
+
+    source_file &file = source_files[filename];
+    file.text = NULL;
+    file.size = 0;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text != MAP_FAILED) {
+            file.text = static_cast<const char *>(text);
+            file.size = st.st_size;
+        }
+    }
+    close(fd);
+    if (file.text == NULL)
+        return NULL;
+    for (size_t pos = 0; pos < file.size; ) {
+        file.line_starts.push_back(pos);
+        const void *end = memchr(file.text + pos, '\n', file.size - pos);
+        if (end == NULL)
+            break;
+        pos = static_cast<const char *>(end) - file.text + 1;
+    }
+    return &file;
+}
+
+
 /* Reads the 'line_number'th line from the file filename. */
 std::string read_line_from_file(std::string filename, unsigned int line_number)
 {
-    std::ifstream in(filename.c_str());
-    if (!in.is_open()) {
+    const source_file *file = open_source_file(filename);
+    if (file == NULL) {
         return "";
     }
     if (line_number == 0) {
         return "Line number must be positive";
     }
-    unsigned int n = 0;
-    std::string line;
-    while (n < line_number) {
-        if (in.eof())
-            return "Line not found";
-        getline(in, line);
-        n += 1; // loop update
-    }
-    return line;
+    if (line_number > file->line_starts.size())
+        return "Line not found";
+    size_t begin = file->line_starts[line_number - 1];
+    size_t end = line_number < file->line_starts.size() ?
+        file->line_starts[line_number] - 1 : file->size;
+    if (end > begin && file->text[end - 1] == '\n')
+        end--;
+    return std::string(file->text + begin, end - begin);
 }
 
 /* Demangles the function name if needed (if the 'name' is coming from C, it
@@ -356,9 +473,80 @@ int load_symbol_table(bfd *abfd, line_data *data)
 }
 
 
+/* A binary opened once with its symbol table loaded, or the reason it
+   could not be.
+*/
+struct symbol_module {
+    bfd *abfd;
+    asymbol **symbol_table;
+    std::string error;
+};
+
+std::map<std::string, symbol_module> symbol_modules;
+
+
+symbol_module &open_symbol_module(const std::string &file_name)
+{
+    std::map<std::string, symbol_module>::iterator it = symbol_modules.find(file_name);
+    if (it != symbol_modules.end())
+        return it->second;
+
+    if (symbol_modules.empty())
+        bfd_init();
+    symbol_module &module = symbol_modules[file_name];
+    module.abfd = NULL;
+    module.symbol_table = NULL;
+    bfd *abfd = bfd_openr(file_name.c_str(), NULL);
+    if (abfd == NULL) {
+        module.error = "Cannot open the binary file '" + file_name + "'\n";
+        return module;
+    }
+    char **matching;
+    if (bfd_check_format(abfd, bfd_archive))
+        module.error = "Cannot get addresses from the archive '" + file_name + "'\n";
+    else if (!bfd_check_format_matches(abfd, bfd_object, &matching))
+        module.error = "Unknown format of the binary file '" + file_name + "'\n";
+    if (module.error != "") {
+        bfd_close(abfd);
+        return module;
+    }
+    line_data data;
+    data.symbol_table = NULL;
+    // This allocates the symbol_table, which is kept with the handle:
+    if (load_symbol_table(abfd, &data) == 1) {
+        module.error = "Failed to load the symbol table from '" + file_name + "'\n";
+        bfd_close(abfd);
+        return module;
+    }
+    module.abfd = abfd;
+    module.symbol_table = data.symbol_table;
+    return module;
+}
+
+
 #endif // HAVE_TEUCHOS_BFD
 
 
+/* Looks 'addr' up in the file 'file_name', leaving the file, function and
+   line in 'data' (data.line_found is 0 if there is none). Returns an error
+   message, or an empty string if the file could be read.
+*/
+std::string find_line(std::string file_name, bfd_vma addr, line_data &data)
+{
+    data.addr = addr;
+    data.line_found = 0;
+#ifdef HAVE_TEUCHOS_BFD
+    symbol_module &module = open_symbol_module(file_name);
+    if (module.error != "")
+        return module.error;
+    data.symbol_table = module.symbol_table;
+    // Loops over all sections and try to find the line
+    bfd_map_over_sections(module.abfd, process_section, &data);
+#endif
+    return "";
+}
+
+
 /* Returns a string of 2 lines for the function with address 'addr' in the file
    'file_name'.
 
@@ -367,35 +555,12 @@ int load_symbol_table(bfd *abfd, line_data *data)
      File "/home/ondrej/repos/rcp/src/Teuchos_RCP.hpp", line 428, in Teuchos::RCP<A>::assert_not_null() const
        throw_null_ptr_error(typeName(*this));
 */
-std::string addr2str(std::string file_name, bfd_vma addr)
+std::string format_frame(std::string file_name, bfd_vma addr)
 {
-#ifdef HAVE_TEUCHOS_BFD
-    // Initialize 'abfd' and do some sanity checks
-    bfd *abfd;
-    abfd = bfd_openr(file_name.c_str(), NULL);
-    if (abfd == NULL)
-        return "Cannot open the binary file '" + file_name + "'\n";
-    if (bfd_check_format(abfd, bfd_archive))
-        return "Cannot get addresses from the archive '" + file_name + "'\n";
-    char **matching;
-    if (!bfd_check_format_matches(abfd, bfd_object, &matching))
-        return "Unknown format of the binary file '" + file_name + "'\n";
-    line_data data;
-    data.addr = addr;
-    data.symbol_table = NULL;
-    data.line_found = false;
-    // This allocates the symbol_table:
-    if (load_symbol_table(abfd, &data) == 1)
-        return "Failed to load the symbol table from '" + file_name + "'\n";
-    // Loops over all sections and try to find the line
-    bfd_map_over_sections(abfd, process_section, &data);
-    // Deallocates the symbol table
-    if (data.symbol_table != NULL) free(data.symbol_table);
-    bfd_close(abfd);
-#else
     line_data data;
-    data.line_found = 0;
-#endif
+    std::string error = find_line(file_name, addr, data);
+    if (error != "")
+        return error;
 
     std::ostringstream s;
     // Do the printing --- print as much information as we were able to
@@ -430,6 +595,42 @@ std::string addr2str(std::string file_name, bfd_vma addr)
     return s.str();
 }
 
+
+/* The last frames formatted by addr2str(), most recently used first. */
+const size_t FRAME_CACHE_SIZE = 4096;
+
+typedef std::pair<std::string, bfd_vma> frame_key;
+
+struct frame_key_hash {
+    size_t operator()(const frame_key &key) const
+    {
+        return std::hash<std::string>()(key.first) ^ std::hash<bfd_vma>()(key.second);
+    }
+};
+
+std::list<std::pair<frame_key, std::string> > frame_cache;
+std::unordered_map<frame_key, std::list<std::pair<frame_key, std::string> >::iterator,
+    frame_key_hash> frame_index;
+
+
+/* format_frame() through the frame cache. */
+std::string addr2str(std::string file_name, bfd_vma addr)
+{
+    frame_key key(file_name, addr);
+    auto it = frame_index.find(key);
+    if (it != frame_index.end()) {
+        frame_cache.splice(frame_cache.begin(), frame_cache, it->second);
+        return it->second->second;
+    }
+    frame_cache.emplace_front(key, format_frame(file_name, addr));
+    frame_index[key] = frame_cache.begin();
+    if (frame_cache.size() > FRAME_CACHE_SIZE) {
+        frame_index.erase(frame_cache.back().first);
+        frame_cache.pop_back();
+    }
+    return frame_cache.front().second;
+}
+
 struct match_data {
     bfd_vma addr;
 
@@ -512,9 +713,7 @@ std::string stacktrace2str(const StacktraceAddresses &stacktrace_addresses)
 
     std::string full_stacktrace_str("Traceback (most recent call last):\n");
 
-#ifdef HAVE_TEUCHOS_BFD
-    bfd_init();
-#endif
+    std::lock_guard<std::mutex> lock(symbolize_mutex);
     // Loop over the stack
     const int stack_depth_start = stack_depth;
     const int stack_depth_end = stacktrace_addresses.get_impl_stacktrace_depth();
@@ -556,22 +755,194 @@ std::string stacktrace2str(const StacktraceAddresses &stacktrace_addresses)
 }
 
 
-void loc_segfault_callback_print_stack(int sig_num)
+/* The crash handler. Everything it needs is set up before any crash: the
+   alternate stack, the module map and backtrace() itself, whose first call
+   loads libgcc_s and allocates. In the handler only backtrace(), write(2)
+   and plain memory accesses are left, so it cannot deadlock on a lock the
+   crashing thread held (malloc, stdio, the dynamic loader) and it costs a
+   few microseconds.
+
+   The report is line oriented text:
+
+     *** crash report
+     signal 11 SIGSEGV address 0x0
+     frame 0x55d0c8a1b2c3
+     ...
+     module 0x55d0c8a00000 0x55d0c8a00000 0x55d0c8a4f000 /path/to/exe
+     ...
+     *** end
+
+   A module line holds the load bias, the lowest and one past the highest
+   mapped address, and the path, so addresses can be mapped back to files
+   offline.
+*/
+
+struct crash_module {
+    uintptr_t base, lo, hi;
+    char name[PATH_MAX];
+};
+
+const int CRASH_MAX_MODULES = 256;
+const int CRASH_MAX_FRAMES = 128;
+
+struct crash_module_set {
+    crash_module modules[CRASH_MAX_MODULES];
+    int count;
+};
+
+/* A refresh fills the set the handler is not reading and then publishes
+   it, so a crash during a refresh still sees a whole snapshot. */
+crash_module_set crash_module_sets[2];
+std::atomic<int> crash_current_set(0);
+static_assert(std::atomic<int>::is_always_lock_free, "read by the crash handler");
+std::mutex crash_refresh_mutex;
+char crash_exe[PATH_MAX];
+char crash_stack[1 << 16];
+
+
+#ifdef HAVE_TEUCHOS_LINK
+int snapshot_module_callback(struct dl_phdr_info *info, size_t, void *_set)
 {
-    std::cout << "\nSegfault caught. Printing stacktrace:\n\n";
-    Teuchos::show_stacktrace();
-    std::cout << "\nDone. Exiting the program.\n";
-    // Deregister our abort callback:
-    signal(SIGABRT, SIG_DFL);
-    abort();
+    crash_module_set &set = *static_cast<crash_module_set *>(_set);
+    if (set.count == CRASH_MAX_MODULES)
+        return 1;
+    crash_module &m = set.modules[set.count];
+    m.base = info->dlpi_addr;
+    m.lo = UINTPTR_MAX;
+    m.hi = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type != PT_LOAD)
+            continue;
+        uintptr_t lo = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        m.lo = std::min(m.lo, lo);
+        m.hi = std::max<uintptr_t>(m.hi, lo + info->dlpi_phdr[i].p_memsz);
+    }
+    if (m.lo >= m.hi)
+        return 0;
+    // The executable itself comes with an empty name.
+    const char *name = info->dlpi_name[0] ? info->dlpi_name : crash_exe;
+    size_t len = strnlen(name, sizeof(m.name) - 1);
+    memcpy(m.name, name, len);
+    m.name[len] = 0;
+    set.count++;
+    return 0;
 }
+#endif // HAVE_TEUCHOS_LINK
 
 
-void loc_abort_callback_print_stack(int sig_num)
+void snapshot_modules()
 {
-    std::cout << "\nAbort caught. Printing stacktrace:\n\n";
-    Teuchos::show_stacktrace();
-    std::cout << "\nDone.\n";
+    std::lock_guard<std::mutex> lock(crash_refresh_mutex);
+    ssize_t n = readlink("/proc/self/exe", crash_exe, sizeof(crash_exe) - 1);
+    crash_exe[n > 0 ? n : 0] = 0;
+    int next = 1 - crash_current_set.load(std::memory_order_relaxed);
+    crash_module_set &set = crash_module_sets[next];
+    set.count = 0;
+#ifdef HAVE_TEUCHOS_LINK
+    dl_iterate_phdr(snapshot_module_callback, &set);
+#endif
+    crash_current_set.store(next, std::memory_order_release);
+}
+
+
+/* Fixed-size output buffer formatted by hand and flushed with write(2). */
+class crash_writer {
+    char buffer[512];
+    int size;
+public:
+    crash_writer(): size(0) {}
+    ~crash_writer() { flush(); }
+    void flush()
+    {
+        const char *p = buffer;
+        while (size > 0) {
+            ssize_t n = write(STDERR_FILENO, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            p += n;
+            size -= n;
+        }
+        size = 0;
+    }
+    crash_writer &put(const char *s)
+    {
+        for (; *s; s++) {
+            if (size == static_cast<int>(sizeof(buffer)))
+                flush();
+            buffer[size++] = *s;
+        }
+        return *this;
+    }
+    crash_writer &hex(uintptr_t v)
+    {
+        char digits[2 + 2 * sizeof(v) + 1];
+        char *p = digits + sizeof(digits) - 1;
+        *p = 0;
+        do {
+            *--p = "0123456789abcdef"[v & 15];
+            v >>= 4;
+        } while (v != 0);
+        *--p = 'x';
+        *--p = '0';
+        return put(p);
+    }
+    crash_writer &dec(int v)
+    {
+        char digits[16];
+        char *p = digits + sizeof(digits) - 1;
+        *p = 0;
+        unsigned u = v < 0 ? -v : v;
+        do {
+            *--p = '0' + u % 10;
+            u /= 10;
+        } while (u != 0);
+        if (v < 0)
+            *--p = '-';
+        return put(p);
+    }
+};
+
+
+const char *crash_signal_name(int sig_num)
+{
+    switch (sig_num) {
+    case SIGSEGV: return "SIGSEGV";
+    case SIGBUS: return "SIGBUS";
+    case SIGFPE: return "SIGFPE";
+    case SIGILL: return "SIGILL";
+    case SIGABRT: return "SIGABRT";
+    default: return "?";
+    }
+}
+
+
+void crash_handler(int sig_num, siginfo_t *info, void *)
+{
+    int saved_errno = errno;
+    void *frames[CRASH_MAX_FRAMES];
+    int n_frames = backtrace(frames, CRASH_MAX_FRAMES);
+    {
+        crash_writer out;
+        out.put("\n*** crash report\nsignal ").dec(sig_num).put(" ")
+            .put(crash_signal_name(sig_num)).put(" address ")
+            .hex(reinterpret_cast<uintptr_t>(info->si_addr)).put("\n");
+        // Frame 0 is this handler.
+        for (int i = 1; i < n_frames; i++)
+            out.put("frame ").hex(reinterpret_cast<uintptr_t>(frames[i])).put("\n");
+        const crash_module_set &set =
+            crash_module_sets[crash_current_set.load(std::memory_order_acquire)];
+        for (int i = 0; i < set.count; i++) {
+            const crash_module &m = set.modules[i];
+            out.put("module ").hex(m.base).put(" ").hex(m.lo).put(" ").hex(m.hi)
+                .put(" ").put(m.name).put("\n");
+        }
+        out.put("*** end\n");
+    }
+    errno = saved_errno;
+    // SA_RESETHAND put the default action back; let it end the process.
+    raise(sig_num);
 }
 
 
@@ -631,11 +1002,150 @@ void Teuchos::show_stacktrace()
 // allow the stream to be set to a different stream.
 
 
+/* A stack overflow leaves no stack to run the handler on, so each thread
+   that may crash needs one of its own. */
+void install_crash_stack(void *base, size_t size)
+{
+    stack_t stack;
+    stack.ss_sp = base;
+    stack.ss_size = size;
+    stack.ss_flags = 0;
+    sigaltstack(&stack, NULL);
+}
+
+
+/* worker_init for the parallel_for pool, whose threads live until exit. */
+void install_worker_crash_stack()
+{
+    install_crash_stack(new char[sizeof(crash_stack)], sizeof(crash_stack));
+}
+
+
 void Teuchos::print_stack_on_segfault()
 {
-    signal(SIGSEGV, loc_segfault_callback_print_stack);
-    signal(SIGABRT, loc_abort_callback_print_stack);
+    // The first backtrace() call loads libgcc_s; get it over with here.
+    void *warm[1];
+    backtrace(warm, 1);
+    snapshot_modules();
+
+    install_crash_stack(crash_stack, sizeof(crash_stack));
+    worker_init = install_worker_crash_stack;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = crash_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    const int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for (int sig_num : signals)
+        sigaction(sig_num, &action, NULL);
+}
+
+
+void Teuchos::refresh_module_map()
+{
+    snapshot_modules();
+}
+
+
+std::string Teuchos::symbol_name(const void *address)
+{
+    struct match_data match;
+    match.addr = (bfd_vma) address;
+#ifdef HAVE_TEUCHOS_LINK
+    if (dl_iterate_phdr(shared_lib_callback, &match) == 0) {
+        std::ostringstream s;
+        s << "0x" << std::hex << match.addr;
+        return s.str();
+    }
+#else
+    match.filename = "";
+    match.addr_in_file = match.addr;
+#endif
+    std::string file_name = match.filename.length() > 0 ? match.filename : "/proc/self/exe";
+    std::lock_guard<std::mutex> lock(symbolize_mutex);
+    line_data data;
+    if (find_line(file_name, match.addr_in_file, data) == "" && data.line_found &&
+        data.function_name.length() > 0)
+        return demangle_function_name(data.function_name);
+    std::string module = match.filename.length() > 0 ? match.filename : std::string(crash_exe);
+    if (module.length() == 0)
+        module = "exe";
+    std::ostringstream s;
+    s << module.substr(module.find_last_of('/') + 1) << "+0x" << std::hex << match.addr_in_file;
+    return s.str();
+}
+
+
+std::string Teuchos::symbolize_crash_report(const std::string &report)
+{
+    struct module {
+        bfd_vma base, lo, hi;
+        std::string name;
+    };
+    std::vector<bfd_vma> frames;
+    std::vector<module> modules;
+    std::string header;
+    std::istringstream in(report);
+    std::string line;
+    bool inside = false;
+    while (getline(in, line)) {
+        if (line == "*** crash report") {
+            inside = true;
+            frames.clear();
+            modules.clear();
+            continue;
+        }
+        if (!inside)
+            continue;
+        if (line == "*** end")
+            break;
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "signal") {
+            header = line;
+        } else if (kind == "frame") {
+            std::string addr;
+            fields >> addr;
+            frames.push_back(std::stoull(addr, NULL, 16));
+        } else if (kind == "module") {
+            std::string base, lo, hi;
+            module m;
+            fields >> base >> lo >> hi;
+            getline(fields, m.name);
+            m.name = remove_leading_whitespace(m.name);
+            m.base = std::stoull(base, NULL, 16);
+            m.lo = std::stoull(lo, NULL, 16);
+            m.hi = std::stoull(hi, NULL, 16);
+            modules.push_back(m);
+        }
+    }
+    if (frames.empty())
+        return "No crash report found\n";
+
+    std::string s = "Crash: " + header + "\nTraceback (most recent call last):\n";
+    std::lock_guard<std::mutex> lock(symbolize_mutex);
+    for (int i = static_cast<int>(frames.size()) - 1; i >= 0; i--) {
+        const module *found = NULL;
+        for (const module &m : modules) {
+            if (frames[i] >= m.lo && frames[i] < m.hi) {
+                found = &m;
+                break;
+            }
+        }
+        if (found == NULL) {
+            std::ostringstream unknown;
+            unknown << "  File unknown, address: 0x" << std::hex << frames[i] << "\n";
+            s += unknown.str();
+        } else {
+            s += addr2str(found->name, frames[i] - found->base);
+        }
+    }
+    return s;
 }
 
 
 #endif // HAVE_TEUCHOS_STACKTRACE
+
+#endif // TEUCHOS_STACKTRACE_IMPL
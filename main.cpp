@@ -6,6 +6,7 @@
 #include<GL/gl.h>
 
 #include "lib/stacktrace.hpp"
+#include "lib/profiler.hpp"
 #include "lib/board.hpp"
 
 Board * board;
@@ -32,7 +33,6 @@ void heartbeat(int) {
 }
 
 void opengl_init(int argc, char** argv, int width, int height) {
-  board = new Board();
   glutInit(&argc, argv);
   glutInitDisplayMode(GLUT_DOUBLE);
   glutInitWindowSize(width, height);
@@ -53,9 +53,47 @@ int main(int argc, char** argv) {
   srand((unsigned)time(NULL));
   std::cin.tie(0);
   std::cin.sync_with_stdio(0);
+  if (argc == 3 && std::string(argv[1]) == "--symbolize") {
+    // Turns a saved crash report back into file names and lines.
+    std::ifstream report(argv[2]);
+    std::stringstream text;
+    text << report.rdbuf();
+    std::cout << Teuchos::symbolize_crash_report(text.str());
+    return 0;
+  }
   Teuchos::print_stack_on_segfault();
+  const char* profile = getenv("PARTICLES_PROFILE");
+  if (profile != NULL && !profiler::start_from_spec(profile)) {
+    std::cerr << "bad PARTICLES_PROFILE: " << profile << std::endl;
+  }
+  const char* display = getenv("PARTICLES_DISPLAY");
+  std::string backend = display ? display : "glut";
+  Presenter* presenter = make_presenter(backend);
+  if (presenter == NULL) {
+    return 1;
+  }
+  board = new Board();
+  board -> img -> presenter = presenter;
+  const char* indexed = getenv("PARTICLES_INDEXED");
+  if (indexed != NULL && std::string(indexed) == "0") {
+    board -> set_indexed(false);
+  }
+
+  if (backend != "glut") {
+    // Headless run: no window, frames go straight to the presenter.
+    const char* frames = getenv("PARTICLES_FRAMES");
+    int limit = frames ? atoi(frames) : 0;
+    for (int frame = 0; limit == 0 || frame < limit; frame++) {
+      board -> heartbeat();
+    }
+    delete presenter;
+    return 0;
+  }
+
   int width = 800, height = 800;
   opengl_init(argc, argv, width, height);
+  // The window brought in the GL driver libraries.
+  Teuchos::refresh_module_map();
   glutMouseFunc(eventoClick);
   glutMotionFunc(eventoArrastre);
   glutDisplayFunc(renderFunction);